@@ -0,0 +1,123 @@
+// Compares the follow modes on a compile-heavy job: a shell runs cc on a small
+// file many times through xargs -P, so every compile is a tree of driver, cc1, as
+// and collect processes. Reports wall time, processes seen and the CPU spent on
+// the logp side.
+//
+//   bench/follow_compile <none|preload|proc|ptrace> [compiles] [parallel]
+
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <atomic>
+
+#include "nlohmann/json.hpp"
+
+#include "logp/preloadwatcher.h"
+#include "logp/procwatcher.h"
+#include "logp/ptracewatcher.h"
+#include "logp/util.h"
+
+
+logp::config conf;
+
+
+static double cpu_secs(struct rusage &ru) {
+    return (logp::util::timeval_to_usecs(ru.ru_utime) + logp::util::timeval_to_usecs(ru.ru_stime)) / 1e6;
+}
+
+int main(int argc, char **argv) {
+    std::string mode = argc > 1 ? argv[1] : "preload";
+    size_t compiles = argc > 2 ? std::stoull(argv[2]) : 100;
+    size_t parallel = argc > 3 ? std::stoull(argv[3]) : 4;
+
+    if (mode != "none" && mode != "preload" && mode != "proc" && mode != "ptrace") {
+        std::cerr << "usage: " << argv[0] << " <none|preload|proc|ptrace> [compiles] [parallel]" << std::endl;
+        return 1;
+    }
+
+    char dir[] = "/tmp/logp-bench-XXXXXX";
+    if (!mkdtemp(dir)) return 1;
+
+    std::string source = std::string(dir) + "/t.c";
+    std::ofstream(source) << "#include <stdio.h>\n#include <string.h>\n"
+                             "int main(int argc, char **argv) { for (int i = 0; i < argc; i++) printf(\"%zu\\n\", strlen(argv[i])); return 0; }\n";
+
+    std::string script = std::string("cd ") + dir + " && seq " + std::to_string(compiles) + " | xargs -P " + std::to_string(parallel)
+                       + " -I{} cc -O1 -o t{} t.c && rm -f t*";
+
+    std::atomic<size_t> started(0), ended(0);
+    auto on_start = [&](uint64_t, nlohmann::json &){ started++; };
+    auto on_end = [&](uint64_t, nlohmann::json &){ ended++; };
+
+    logp::preload_watcher preloadwatcher;
+    logp::proc_watcher procwatcher;
+    logp::ptrace_watcher ptracewatcher;
+
+    preloadwatcher.on_proc_start = procwatcher.on_proc_start = ptracewatcher.on_proc_start = on_start;
+    preloadwatcher.on_proc_end = procwatcher.on_proc_end = ptracewatcher.on_proc_end = on_end;
+
+    std::atomic<bool> root_exited(false);
+    ptracewatcher.on_root_exit = [&](uint64_t, int, struct rusage &){ root_exited = true; };
+
+    if (mode == "preload") {
+        char preload_path[PATH_MAX];
+        if (!realpath("logp_preload.so", preload_path)) {
+            std::cerr << "run from the directory containing logp_preload.so" << std::endl;
+            return 1;
+        }
+
+        preloadwatcher.run();
+
+        setenv("LD_PRELOAD", preload_path, 1);
+        setenv("LOGP_SOCKET_PATH", preloadwatcher.get_socket_path().c_str(), 1);
+        if (preloadwatcher.get_ring_path().size()) setenv("LOGP_RING_PATH", preloadwatcher.get_ring_path().c_str(), 1);
+        if (preloadwatcher.get_pidfd_supported()) setenv("LOGP_PIDFD", "1", 1);
+    } else if (mode == "ptrace") {
+        ptracewatcher.prepare();
+    }
+
+    uint64_t start = logp::util::curr_time();
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        if (mode == "ptrace") ptracewatcher.child();
+        execl("/bin/sh", "sh", "-c", script.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+
+    if (mode == "proc") procwatcher.run(pid);
+    else if (mode == "ptrace") ptracewatcher.run(pid);
+
+    if (mode == "ptrace") {
+        while (!root_exited) usleep(1000);
+    } else {
+        waitpid(pid, nullptr, 0);
+    }
+
+    uint64_t finished = logp::util::curr_time();
+
+    if (mode == "preload") {
+        while (ended < started && logp::util::curr_time() - finished < 5*1000000) usleep(1000);
+    } else if (mode == "proc") {
+        procwatcher.stop();
+    }
+
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    std::cout << mode << ": " << compiles << " compiles, " << parallel << " parallel\n"
+              << "  wall time:        " << (finished - start) / 1000 << " ms\n"
+              << "  starts/exits seen " << started << "/" << ended << "\n"
+              << "  CPU: logp side " << cpu_secs(self) << " s, job " << cpu_secs(children) << " s" << std::endl;
+
+    rmdir(dir);
+
+    _exit(0);
+}
@@ -0,0 +1,108 @@
+// Fork storm benchmark for process following. Spawns many short-lived processes
+// under logp_preload.so and measures how long it takes until the watcher has seen
+// every start and exit, and how much CPU the reporting costs.
+//
+//   bench/preload_storm <none|socket|ring> [processes] [parallel] [command]
+
+#include <spawn.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <iostream>
+#include <string>
+#include <atomic>
+
+#include "nlohmann/json.hpp"
+
+#include "logp/preloadwatcher.h"
+#include "logp/util.h"
+
+
+logp::config conf;
+
+extern char **environ;
+
+
+static double cpu_secs(struct rusage &ru) {
+    return (logp::util::timeval_to_usecs(ru.ru_utime) + logp::util::timeval_to_usecs(ru.ru_stime)) / 1e6;
+}
+
+int main(int argc, char **argv) {
+    std::string transport = argc > 1 ? argv[1] : "ring";
+    size_t procs = argc > 2 ? std::stoull(argv[2]) : 5000;
+    size_t parallel = argc > 3 ? std::stoull(argv[3]) : 16;
+    const char *command = argc > 4 ? argv[4] : "/bin/true";
+
+    if (transport != "none" && transport != "socket" && transport != "ring") {
+        std::cerr << "usage: " << argv[0] << " <none|socket|ring> [processes] [parallel] [command]" << std::endl;
+        return 1;
+    }
+
+    std::atomic<size_t> started(0), ended(0);
+
+    logp::preload_watcher watcher;
+    watcher.use_ring = transport == "ring";
+    watcher.on_proc_start = [&](uint64_t, nlohmann::json &){ started++; };
+    watcher.on_proc_end = [&](uint64_t, nlohmann::json &){ ended++; };
+
+    if (transport != "none") {
+        char preload_path[PATH_MAX];
+        if (!realpath("logp_preload.so", preload_path)) {
+            std::cerr << "run from the directory containing logp_preload.so" << std::endl;
+            return 1;
+        }
+
+        watcher.run();
+
+        setenv("LD_PRELOAD", preload_path, 1);
+        setenv("LOGP_SOCKET_PATH", watcher.get_socket_path().c_str(), 1);
+        if (watcher.get_ring_path().size()) setenv("LOGP_RING_PATH", watcher.get_ring_path().c_str(), 1);
+        if (watcher.get_pidfd_supported()) setenv("LOGP_PIDFD", "1", 1);
+    }
+
+    uint64_t start = logp::util::curr_time();
+    size_t running = 0;
+
+    for (size_t i = 0; i < procs; i++) {
+        if (running == parallel) {
+            int status;
+            if (wait(&status) > 0) running--;
+        }
+
+        pid_t pid;
+        char *child_argv[] = { const_cast<char *>(command), nullptr };
+        if (posix_spawn(&pid, command, nullptr, nullptr, child_argv, environ) != 0) {
+            std::cerr << "posix_spawn failed" << std::endl;
+            return 1;
+        }
+
+        running++;
+    }
+
+    while (running) {
+        int status;
+        if (wait(&status) > 0) running--;
+    }
+
+    uint64_t spawned = logp::util::curr_time();
+
+    if (transport != "none") {
+        while ((started < procs || ended < procs) && logp::util::curr_time() - spawned < 10*1000000) usleep(1000);
+    }
+
+    uint64_t reported = logp::util::curr_time();
+
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    std::cout << transport << ": " << procs << " processes, " << parallel << " parallel\n"
+              << "  spawn and reap:   " << (spawned - start) / 1000 << " ms (" << (spawned - start) / procs << " us/process)\n"
+              << "  all reported:     " << (reported - start) / 1000 << " ms\n"
+              << "  starts/exits seen " << started << "/" << ended << "\n"
+              << "  CPU: logp side " << cpu_secs(self) << " s, processes " << cpu_secs(children) << " s" << std::endl;
+
+    _exit(0);
+}
@@ -0,0 +1,119 @@
+// CPU overhead of following processes by polling /proc. A spawner process starts
+// sleep processes of the given lifetime at each given rate, and the proc_watcher
+// follows it. The benchmark itself only waits, so its own CPU time is what the
+// watcher costs. Processes shorter than the poll interval are mostly not seen.
+//
+//   bench/proc_poll [seconds] [lifetime ms] [processes/second ...]
+
+#include <spawn.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "nlohmann/json.hpp"
+
+#include "logp/procwatcher.h"
+#include "logp/util.h"
+
+
+logp::config conf;
+
+extern char **environ;
+
+
+static uint64_t cpu_usecs(struct rusage &ru) {
+    return logp::util::timeval_to_usecs(ru.ru_utime) + logp::util::timeval_to_usecs(ru.ru_stime);
+}
+
+// Runs in the forked spawner, returns how many processes it started
+static uint64_t spawn_at_rate(uint64_t rate, uint64_t duration, std::string lifetime) {
+    uint64_t start = logp::util::curr_time();
+    uint64_t spawned = 0;
+
+    while (1) {
+        uint64_t elapsed = logp::util::curr_time() - start;
+        if (elapsed >= duration) break;
+
+        while (waitpid(-1, nullptr, WNOHANG) > 0) {}
+
+        if (!rate || spawned >= elapsed * rate / 1000000) {
+            usleep(rate ? std::min<uint64_t>(1000000 / rate, 10000) : 10000);
+            continue;
+        }
+
+        pid_t pid;
+        char *child_argv[] = { const_cast<char *>("sleep"), const_cast<char *>(lifetime.c_str()), nullptr };
+        if (posix_spawnp(&pid, "sleep", nullptr, nullptr, child_argv, environ) == 0) spawned++;
+    }
+
+    while (wait(nullptr) > 0) {}
+
+    return spawned;
+}
+
+int main(int argc, char **argv) {
+    uint64_t seconds = argc > 1 ? std::stoull(argv[1]) : 3;
+    uint64_t lifetime_ms = argc > 2 ? std::stoull(argv[2]) : 50;
+
+    char lifetime[32];
+    snprintf(lifetime, sizeof(lifetime), "%.3f", lifetime_ms / 1000.0);
+
+    std::vector<uint64_t> rates;
+    for (int i = 3; i < argc; i++) rates.push_back(std::stoull(argv[i]));
+    if (rates.empty()) rates = { 0, 10, 100, 1000 };
+
+    if (!logp::proc_watcher::supported()) {
+        std::cerr << "/proc/<pid>/task/<tid>/children not available" << std::endl;
+        return 1;
+    }
+
+    std::cout << lifetime_ms << " ms processes for " << seconds << " s at each rate\n"
+              << "rate/s  spawned  seen  scans  watcher CPU   % of a core" << std::endl;
+
+    for (auto rate : rates) {
+        int fds[2];
+        if (pipe(fds)) return 1;
+
+        struct rusage before, after;
+        getrusage(RUSAGE_SELF, &before);
+
+        pid_t spawner = fork();
+
+        if (spawner == 0) {
+            close(fds[0]);
+            uint64_t spawned = spawn_at_rate(rate, seconds * 1000000, lifetime);
+            if (write(fds[1], &spawned, sizeof(spawned)) != sizeof(spawned)) _exit(1);
+            _exit(0);
+        }
+
+        close(fds[1]);
+
+        std::atomic<uint64_t> seen(0);
+
+        logp::proc_watcher watcher;
+        watcher.on_proc_start = [&](uint64_t, nlohmann::json &data){ if (data["ppid"] == spawner) seen++; };
+        watcher.run(spawner);
+
+        uint64_t spawned = 0;
+        if (read(fds[0], &spawned, sizeof(spawned)) != sizeof(spawned)) spawned = 0;
+        close(fds[0]);
+
+        waitpid(spawner, nullptr, 0);
+        watcher.stop();
+
+        getrusage(RUSAGE_SELF, &after);
+
+        uint64_t cpu = cpu_usecs(after) - cpu_usecs(before);
+
+        printf("%6lu  %7lu  %4lu  %5lu  %8.1f ms   %6.2f%%\n",
+               (unsigned long)rate, (unsigned long)spawned, (unsigned long)seen.load(), (unsigned long)watcher.scans,
+               cpu / 1000.0, 100.0 * cpu / (seconds * 1000000));
+    }
+
+    return 0;
+}
@@ -0,0 +1,152 @@
+// Fixed overhead of `logp run`: runs `./logp run --timings true` many times and
+// compares its wall time with running true directly. The phases reported by
+// --timings are averaged over the runs. The upload needs a working config (or
+// LOGP_APIKEY), and includes the round trip to the server, so the phases before
+// "job exited" are the part logp itself adds.
+//
+//   bench/run_true [runs] [extra logp run options ...]
+
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/wait.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "logp/util.h"
+
+
+logp::config conf;
+
+
+struct phase {
+    std::string name;
+    double total_ms = 0;
+    size_t count = 0;
+};
+
+// Runs argv, returning its wall time in microseconds or 0 on failure. Its stderr
+// is collected in err when given.
+static uint64_t time_run(std::vector<const char *> argv, std::string *err) {
+    argv.push_back(nullptr);
+
+    int fds[2];
+    if (err && pipe(fds)) return 0;
+
+    uint64_t start = logp::util::monotonic_time();
+
+    pid_t pid = fork();
+    if (pid == -1) return 0;
+
+    if (pid == 0) {
+        if (err) {
+            dup2(fds[1], 2);
+            close(fds[0]);
+            close(fds[1]);
+        }
+
+        execvp(argv[0], const_cast<char **>(argv.data()));
+        _exit(127);
+    }
+
+    if (err) {
+        close(fds[1]);
+        err->clear();
+
+        char buf[4096];
+        ssize_t ret;
+        while ((ret = read(fds[0], buf, sizeof(buf))) > 0) err->append(buf, ret);
+        close(fds[0]);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    uint64_t elapsed = logp::util::monotonic_time() - start;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? elapsed : 0;
+}
+
+static void print_stats(const char *name, std::vector<uint64_t> &times) {
+    std::sort(times.begin(), times.end());
+
+    double sum = 0;
+    for (auto t : times) sum += t;
+
+    auto pct = [&](double p){ return times[std::min(times.size() - 1, static_cast<size_t>(p * times.size()))] / 1000.0; };
+
+    printf("%-10s  mean %8.3f  p50 %8.3f  p90 %8.3f  p99 %8.3f  max %8.3f ms\n",
+           name, sum / times.size() / 1000.0, pct(0.5), pct(0.9), pct(0.99), times.back() / 1000.0);
+}
+
+int main(int argc, char **argv) {
+    size_t runs = argc > 1 ? std::stoull(argv[1]) : 1000;
+
+    if (access("./logp", X_OK) != 0) {
+        std::cerr << "run from the directory containing logp" << std::endl;
+        return 1;
+    }
+
+    std::vector<const char *> logp_argv = { "./logp", "run", "--timings" };
+    for (int i = 2; i < argc; i++) logp_argv.push_back(argv[i]);
+    logp_argv.push_back("true");
+
+    std::string err;
+
+    if (!time_run(logp_argv, &err)) {
+        std::cerr << "logp run failed, skipping (is an apikey configured?):\n" << err << std::endl;
+        return 0;
+    }
+
+    std::vector<uint64_t> bare_times, logp_times;
+    std::vector<phase> phases;
+
+    for (size_t i = 0; i < runs; i++) {
+        bare_times.push_back(time_run({ "true" }, nullptr));
+
+        uint64_t t = time_run(logp_argv, &err);
+        if (!t) {
+            std::cerr << "logp run failed:\n" << err << std::endl;
+            return 1;
+        }
+        logp_times.push_back(t);
+
+        // "  <ms since start> <ms since previous>  <phase name>"
+        size_t pos = 0, eol;
+
+        for (size_t index = 0; (eol = err.find('\n', pos)) != std::string::npos; pos = eol + 1) {
+            std::string line = err.substr(pos, eol - pos);
+
+            double at, delta;
+            int name_offset = 0;
+            if (sscanf(line.c_str(), " %lf %lf %n", &at, &delta, &name_offset) != 2 || !name_offset) continue;
+
+            std::string name = line.substr(name_offset);
+            auto it = std::find_if(phases.begin(), phases.end(), [&](phase &p){ return p.name == name; });
+
+            if (it == phases.end()) {
+                phase p;
+                p.name = name;
+                it = phases.insert(phases.begin() + std::min(index, phases.size()), p);
+            }
+
+            it->total_ms += at;
+            it->count++;
+            index = it - phases.begin() + 1;
+        }
+    }
+
+    std::cout << runs << " runs of " << logp_argv[0];
+    for (size_t i = 1; i < logp_argv.size(); i++) std::cout << " " << logp_argv[i];
+    std::cout << "\n\n";
+
+    print_stats("true", bare_times);
+    print_stats("logp run", logp_times);
+
+    std::cout << "\nmean ms since logp started:\n";
+    for (auto &p : phases) printf("  %9.3f  %s\n", p.total_ms / p.count, p.name.c_str());
+
+    return 0;
+}
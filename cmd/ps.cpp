@@ -275,6 +275,18 @@ void process_follow(nlohmann::json &res) {
 
             if (res["ty"] == "stderr") text = logp::util::colour_red(text);
             std::cout << text;
+        } else if (res.count("da") && res["da"].count("json")) {
+            std::cout << res["da"]["json"].dump();
+        } else if (res.count("da") && res["da"].count("z")) {
+            std::cout << "[compressed output, use logp tail]";
+        } else if (res.count("da") && res["da"].count("elided")) {
+            std::cout << "[... " << res["da"]["elided"].get<uint64_t>() << " bytes elided ...]";
+        }
+
+        if (res.count("da") && res["da"].count("rp")) {
+            uint64_t repeats = 0;
+            for (auto &r : res["da"]["rp"]) repeats += r[1].get<uint64_t>();
+            std::cout << " [+" << repeats << " repeated lines]";
         }
 
         std::cout << std::endl;
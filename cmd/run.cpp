@@ -3,6 +3,8 @@
 #include <errno.h>
 #include <pwd.h>
 #include <fnmatch.h>
+#include <fcntl.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/wait.h>
@@ -14,6 +16,11 @@
 #include <memory>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <algorithm>
 
 #include "mapbox/variant.hpp"
 #include "nlohmann/json.hpp"
@@ -23,7 +30,17 @@
 #include "logp/websocket.h"
 #include "logp/signalwatcher.h"
 #include "logp/preloadwatcher.h"
+#include "logp/procwatcher.h"
+#include "logp/ptracewatcher.h"
+#include "logp/procagg.h"
+#include "logp/proctree.h"
+#include "logp/procsampler.h"
+#include "logp/jobcgroup.h"
+#include "logp/perfcounters.h"
+#include "logp/detacher.h"
 #include "logp/pipecapturer.h"
+#include "logp/pty.h"
+#include "logp/compress.h"
 #include "logp/event.h"
 #include "logp/util.h"
 
@@ -34,25 +51,69 @@ namespace logp { namespace cmd {
 const char *run::usage() {
     static const char *u =
         "logp run [options] <command>\n"
-        "  -t <tag>    Add a tag to this job\n"
+        "logp run [options] --manifest <file> [-j <n>]\n"
+        "  -t <tag>                  Add a tag to this job\n"
+        "  --capture-fd <n>[:<name>] Also capture descriptor n as entry type name (default fdN)\n"
+        "  --capture-fifo <path>     Capture what the job writes to FIFO path (created if needed)\n"
+        "  --pty                     Run the command on a pseudo-terminal (stdout and stderr are merged)\n"
+        "  --follow <mode>           How to follow subprocesses: preload, proc, ptrace or false\n"
+        "  --sample                  Upload CPU, memory and I/O samples of the job's processes\n"
+        "  --perf                    Count cycles, instructions, cache misses etc with perf_event_open\n"
+        "  --detach                  Exit as soon as the job is done and finish uploading in the background\n"
+        "  --timings                 Print how long each phase of logp's startup and shutdown took\n"
+        "  --manifest <file>         Run each command in file (- for stdin) as its own job, see below\n"
+        "  -j/--jobs <n>             With --manifest, how many to run at once (default: CPUs)\n"
         "\n"
-        "  <command>   This is a unix command, possibly including options\n"
+        "  <command>                 This is a unix command, possibly including options\n"
+        "\n"
+        "  Manifest lines are shell commands, or JSON objects like\n"
+        "  {\"id\": \"b\", \"cmd\": \"make b\", \"after\": [\"a\"]} to run once the jobs listed have succeeded\n"
+        "  Each job's stdout and stderr are passed through to logp's, so the output of jobs running\n"
+        "  at once is interleaved. --pty, --follow, --sample, --perf, --capture-fd, --capture-fifo\n"
+        "  and --detach can't be used with --manifest\n"
     ;
 
     return u;
 }
 
-const char *run::getopt_string() { return "t:"; }
+const char *run::getopt_string() { return "t:j:"; }
+
+enum {
+    OPT_CAPTURE_FD = 1000,
+    OPT_CAPTURE_FIFO,
+    OPT_PTY,
+    OPT_FOLLOW,
+    OPT_SAMPLE,
+    OPT_PERF,
+    OPT_MANIFEST,
+    OPT_DETACH,
+    OPT_TIMINGS,
+};
 
 struct option *run::get_long_options() {
     static struct option opts[] = {
         {"tag", required_argument, 0, 't'},
+        {"capture-fd", required_argument, 0, OPT_CAPTURE_FD},
+        {"capture-fifo", required_argument, 0, OPT_CAPTURE_FIFO},
+        {"pty", no_argument, 0, OPT_PTY},
+        {"follow", required_argument, 0, OPT_FOLLOW},
+        {"sample", no_argument, 0, OPT_SAMPLE},
+        {"perf", no_argument, 0, OPT_PERF},
+        {"manifest", required_argument, 0, OPT_MANIFEST},
+        {"jobs", required_argument, 0, 'j'},
+        {"detach", no_argument, 0, OPT_DETACH},
+        {"timings", no_argument, 0, OPT_TIMINGS},
         {0, 0, 0, 0}
     };
 
     return opts;
 }
 
+static void check_entry_type_name(std::string name) {
+    if (!name.size()) throw logp::error("empty capture name");
+    if (name == "cmd" || name == "proc" || name == "stdout" || name == "stderr") throw logp::error("capture name '", name, "' is reserved");
+}
+
 void run::process_option(int arg, int, char *optarg) {
     switch (arg) {
       case 0:
@@ -61,6 +122,70 @@ void run::process_option(int arg, int, char *optarg) {
       case 't':
         opt_tag = std::string(optarg);
         break;
+
+      case OPT_CAPTURE_FD:
+        {
+            std::string spec(optarg);
+            std::string name;
+
+            auto colon_pos = spec.find(':');
+            if (colon_pos != std::string::npos) {
+                name = spec.substr(colon_pos + 1);
+                spec = spec.substr(0, colon_pos);
+            }
+
+            int fd = std::stoi(spec);
+            if (fd <= 2) throw logp::error("--capture-fd must be 3 or higher (stdout and stderr are captured by default)");
+
+            if (!name.size()) name = std::string("fd") + std::to_string(fd);
+            check_entry_type_name(name);
+
+            opt_capture_fds.emplace_back(fd, name);
+        }
+        break;
+
+      case OPT_CAPTURE_FIFO:
+        {
+            std::string path(optarg);
+            std::string name = path.substr(path.find_last_of('/') + 1);
+            check_entry_type_name(name);
+
+            opt_capture_fifos.emplace_back(path, name);
+        }
+        break;
+
+      case OPT_PTY:
+        opt_pty = true;
+        break;
+
+      case OPT_FOLLOW:
+        opt_follow = std::string(optarg);
+        break;
+
+      case OPT_SAMPLE:
+        opt_sample = true;
+        break;
+
+      case OPT_PERF:
+        opt_perf = true;
+        break;
+
+      case OPT_DETACH:
+        opt_detach = true;
+        break;
+
+      case OPT_TIMINGS:
+        opt_timings = true;
+        break;
+
+      case OPT_MANIFEST:
+        opt_manifest = std::string(optarg);
+        break;
+
+      case 'j':
+        opt_jobs = std::stoull(optarg);
+        if (!opt_jobs) throw logp::error("-j must be at least 1");
+        break;
     };
 }
 
@@ -98,10 +223,9 @@ struct run_msg_websocket_flushed {
 };
 
 struct run_msg_pipe_data {
-    int fd = -1;
+    size_t stream = 0;
     bool finished = false;
-    uint64_t timestamp = 0;
-    std::string data;
+    logp::capture_chunk chunk;
 };
 
 struct run_msg_proc_started {
@@ -114,358 +238,1530 @@ struct run_msg_proc_exited {
     nlohmann::json data;
 };
 
-using run_msg = mapbox::util::variant<run_msg_sigchld, run_msg_websocket_flushed, run_msg_pipe_data, run_msg_proc_started, run_msg_proc_exited>;
-
+struct run_msg_proc_tick {
+};
 
-void run::execute() {
-    if (!my_argv[optind]) {
-        PRINT_ERROR << "Must provide a command after run, ie 'logp run sleep 10'";
-        print_usage_and_exit();
-    }
+struct run_msg_proc_samples {
+    uint64_t timestamp;
+    nlohmann::json data;
+};
 
-    config_stderr = ::conf.get_bool("run.stderr", true);
-    config_stdout = ::conf.get_bool("run.stdout", true);
-    config_follow = ::conf.get_bool("run.follow", true);
+// The job was reaped by the ptrace tracer rather than in response to SIGCHLD
+struct run_msg_job_exited {
+    uint64_t timestamp;
+    int status;
+    struct rusage resource_usage;
+};
 
+using run_msg = mapbox::util::variant<run_msg_sigchld, run_msg_websocket_flushed, run_msg_pipe_data, run_msg_proc_started, run_msg_proc_exited, run_msg_proc_tick, run_msg_proc_samples, run_msg_job_exited>;
 
-    hoytech::protected_queue<run_msg> cmd_run_queue;
 
 
-    struct sigaction sa;
-    sa.sa_handler = [](int){};
-    sa.sa_flags = SA_NOCLDSTOP;
-    sigaction(SIGCHLD, &sa, nullptr);
+struct captured_stream {
+    std::string type; // entry type
+    std::unique_ptr<logp::pipe_capturer> capturer;
+    bool finished = false;
+    uint64_t rate_limited_bytes = 0; // dropped, not yet reported in an elided marker
+    std::unique_ptr<logp::deflate_stream> compressor;
+    uint64_t compressed_seq = 0;
+    bool json_lines = false;
+};
 
-    logp::signal_watcher sigwatcher;
 
-    sigwatcher.subscribe(SIGCHLD, [&](){
-        run_msg_sigchld m;
-        cmd_run_queue.push_move(m);
-    });
+// Token bucket shared by all captured streams of an event
 
-    logp::preload_watcher preloadwatcher;
+class output_rate_limiter {
+  public:
+    output_rate_limiter(uint64_t rate_, uint64_t burst_) : rate(rate_), burst(burst_), tokens(burst_) {}
 
-    hoytech::timer timer;
+    // Returns how many of len bytes may be uploaded
+    size_t admit(size_t len, uint64_t now) {
+        if (!rate) return len;
 
-    bool kill_timeout_normal_shutdown = false;
-    bool kill_timeout_timer_started = false;
+        if (now > last_refill) {
+            if (last_refill) tokens = std::min(static_cast<double>(burst), tokens + (now - last_refill) * rate / 1000000.0);
+            last_refill = now;
+        }
 
-    auto kill_signal_handler = [&](){
-        if (kill_timeout_timer_started) return;
-        kill_timeout_timer_started = true;
+        size_t allowed = std::min(len, static_cast<size_t>(tokens));
+        tokens -= allowed;
+        return allowed;
+    }
 
-        if (!kill_timeout_normal_shutdown) PRINT_WARNING << "attempting to communicate with log periodic server, please wait...";
+  private:
+    uint64_t rate;
+    uint64_t burst;
+    double tokens;
+    uint64_t last_refill = 0;
+};
 
-        timer.once(4*1000000, []{
-            PRINT_ERROR << "was unable to communicate with log periodic server";
-            exit(1);
-        });
-    };
 
-    sigwatcher.subscribe(SIGHUP, kill_signal_handler);
-    sigwatcher.subscribe(SIGINT, kill_signal_handler);
-    sigwatcher.subscribe(SIGQUIT, kill_signal_handler);
-    sigwatcher.subscribe(SIGTERM, kill_signal_handler);
+// Keeps the first size bytes of a chunk and the lines and repeats within them
+static void cut_chunk_back(logp::capture_chunk &c, size_t size) {
+    c.data.resize(size);
 
+    uint64_t newlines = logp::util::count_newlines(c.data.data(), c.data.size());
+    size_t groups = 0;
 
+    while (groups < c.lines.size() && newlines) {
+        auto &g = c.lines[groups++];
+        if (g.count > newlines) g.count = newlines;
+        newlines -= g.count;
+    }
 
+    c.lines.erase(c.lines.begin() + groups, c.lines.end());
 
-    preloadwatcher.on_proc_start = [&](uint64_t ts, nlohmann::json &data){
-        run_msg_proc_started m{ts, std::move(data)};
-        cmd_run_queue.push_move(m);
-    };
+    while (c.repeats.size() && c.repeats.back().offset > c.data.size()) c.repeats.pop_back();
+}
 
-    preloadwatcher.on_proc_end = [&](uint64_t ts, nlohmann::json &data){
-        run_msg_proc_exited m{ts, std::move(data)};
-        cmd_run_queue.push_move(m);
-    };
+// Drops the first cut bytes of a chunk and the lines and repeats within them
+static void cut_chunk_front(logp::capture_chunk &c, size_t cut) {
+    uint64_t newlines = logp::util::count_newlines(c.data.data(), cut);
+    c.data.erase(0, cut);
+
+    while (newlines && c.lines.size()) {
+        auto &g = c.lines.front();
+        uint64_t n = std::min(g.count, newlines);
+        g.count -= n;
+        newlines -= n;
+        if (!g.count) c.lines.erase(c.lines.begin());
+    }
 
+    std::vector<logp::capture_repeat> repeats;
 
+    for (auto &r : c.repeats) {
+        if (r.offset <= cut) continue;
+        r.offset -= cut;
+        repeats.push_back(r);
+    }
 
+    c.repeats.swap(repeats);
+}
 
-    sigwatcher.run();
-    timer.run();
-    if (config_follow) preloadwatcher.run();
+// Bytes over the limit are reported as elided. Ordinary chunks lose their end, and
+// the marker goes ahead of the next chunk with data. The retained tail loses its
+// start instead, so that the end of the output survives, and the marker goes ahead
+// of it.
+static void rate_limit_chunk(output_rate_limiter &limiter, captured_stream &st, logp::capture_chunk &c, bool finished) {
+    auto &elided = st.rate_limited_bytes;
 
+    size_t allowed = limiter.admit(c.data.size(), c.timestamp);
+    uint64_t dropped = c.data.size() - allowed;
 
-    logp::websocket::worker ws_worker;
+    if (dropped && c.tail) cut_chunk_front(c, dropped);
+    else if (dropped) cut_chunk_back(c, allowed);
 
-    ws_worker.run();
+    if (c.data.size() || finished || c.tail) {
+        // Bytes dropped earlier go in a marker ahead of this chunk
+        c.elided += elided;
+        elided = 0;
+        if (finished && !c.timestamp) c.timestamp = logp::util::curr_time();
+    }
 
+    if (c.tail) c.elided += dropped;
+    else elided += dropped;
+}
 
 
-    std::unique_ptr<logp::pipe_capturer> stderr_pipe_capturer;
-    bool stderr_finished = false;
+// --timings: when each phase of a run was reached, from the monotonic clock
 
-    if (config_stderr) {
-        int fd = 2;
+class phase_timings {
+  public:
+    bool enabled = false;
 
-        stderr_pipe_capturer = std::unique_ptr<logp::pipe_capturer>(new logp::pipe_capturer(fd, timer,
-            [&, fd](std::string &buf, uint64_t timestamp){
-                run_msg_pipe_data m;
-                m.fd = fd;
-                m.timestamp = timestamp;
-                m.data = std::move(buf);
-                cmd_run_queue.push_move(m);
-            },
-            [&, fd](){
-                run_msg_pipe_data m;
-                m.fd = fd;
-                m.finished = true;
-                cmd_run_queue.push_move(m);
-            }
-        ));
+    void mark(const char *phase) {
+        if (enabled) marks.emplace_back(phase, logp::util::monotonic_time());
     }
 
-    std::unique_ptr<logp::pipe_capturer> stdout_pipe_capturer;
-    bool stdout_finished = false;
+    // To stderr, as ms since logp started and since the previous phase
+    void print() {
+        if (!enabled) return;
 
-    if (config_stdout) {
-        int fd = 1;
+        uint64_t prev = logp::util::process_start_time;
 
-        stdout_pipe_capturer = std::unique_ptr<logp::pipe_capturer>(new logp::pipe_capturer(fd, timer,
-            [&, fd](std::string &buf, uint64_t timestamp){
-                run_msg_pipe_data m;
-                m.fd = fd;
-                m.timestamp = timestamp;
-                m.data = std::move(buf);
-                cmd_run_queue.push_move(m);
-            },
-            [&, fd](){
-                run_msg_pipe_data m;
-                m.fd = fd;
-                m.finished = true;
-                cmd_run_queue.push_move(m);
-            }
-        ));
+        fprintf(stderr, "logp: timings (ms since start, ms since previous phase):\n");
+
+        for (auto &m : marks) {
+            fprintf(stderr, "  %9.3f %+9.3f  %s\n", (m.second - logp::util::process_start_time) / 1000.0, (m.second - prev) / 1000.0, m.first);
+            prev = m.second;
+        }
+
+        marks.clear();
     }
 
+  private:
+    std::vector<std::pair<const char *, uint64_t>> marks;
+};
 
-    uint64_t start_timestamp = logp::util::curr_time();
 
-    pid_t ppid = getppid();
+static logp::capture_options::collapse_mode parse_collapse_mode(std::string name) {
+    if (name == "none") return logp::capture_options::collapse_mode::none;
+    if (name == "exact") return logp::capture_options::collapse_mode::exact;
+    if (name == "digits") return logp::capture_options::collapse_mode::digits;
 
-    pid_t fork_ret = fork();
+    throw logp::error("unknown run.collapse mode '", name, "' (expected none, exact or digits)");
+}
 
-    if (fork_ret == -1) {
-        PRINT_ERROR << "unable to fork: " << strerror(errno);
-        _exit(1);
-    } else if (fork_ret == 0) {
-        if (stderr_pipe_capturer) stderr_pipe_capturer->child();
-        if (stdout_pipe_capturer) stdout_pipe_capturer->child();
 
-        if (config_follow) {
-            ::setenv("LOGP_SOCKET_PATH", preloadwatcher.get_socket_path().c_str(), 0);
-            const char *logp_preload_env_var;
-            std::string logp_preload_path = find_logp_preload();
+static std::string parse_follow_mode(std::string name) {
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
 
-#ifdef __APPLE__
-            logp_preload_env_var = "DYLD_INSERT_LIBRARIES";
-#else
-            logp_preload_env_var = "LD_PRELOAD";
-#endif
+    if (name == "t" || name == "true" || name == "1" || name == "preload") return "preload";
+    if (name == "f" || name == "false" || name == "0") return "";
+    if (name == "proc") return "proc";
+    if (name == "ptrace") return "ptrace";
 
-            if (logp_preload_path.size()) ::setenv(logp_preload_env_var, logp_preload_path.c_str(), 0);
+    throw logp::error("unknown follow mode '", name, "' (expected true, false, preload, proc or ptrace)");
+}
+
+
+static void add_text_chunk(logp::event &ev, captured_stream &st, logp::capture_chunk &c) {
+    if (c.data.size() || c.repeats.size()) {
+        nlohmann::json body = {{ "ty", st.type }, { "at", c.timestamp }};
+
+        if (st.compressor && c.data.size()) {
+            // "z" chunks of a stream must be inflated in "zs" order with one context
+            body["da"]["z"] = logp::util::base64_encode(st.compressor->compress(c.data));
+            body["da"]["zs"] = st.compressed_seq++;
+        } else {
+            body["da"]["txt"] = c.data;
         }
 
-        sigwatcher.unblock();
-        execvp(my_argv[optind], my_argv+optind);
-        PRINT_ERROR << "Couldn't exec " << my_argv[optind] << " : " << strerror(errno);
-        _exit(1);
+        if (c.lines.size()) {
+            // [count, microseconds since previous group (or "at")] pairs
+            auto &ln = body["da"]["ln"];
+            uint64_t prev = c.timestamp;
+
+            for (auto &g : c.lines) {
+                uint64_t delta = g.timestamp > prev ? g.timestamp - prev : 0;
+                ln.push_back({ g.count, delta });
+                prev += delta;
+            }
+        }
+
+        if (c.repeats.size()) {
+            // [offset in txt, count, microseconds from "at" to first and last repeat]
+            auto &rp = body["da"]["rp"];
+
+            for (auto &r : c.repeats) {
+                uint64_t first = r.first_timestamp > c.timestamp ? r.first_timestamp - c.timestamp : 0;
+                uint64_t last = r.last_timestamp > c.timestamp ? r.last_timestamp - c.timestamp : 0;
+                rp.push_back({ r.offset, r.count, first, last });
+            }
+        }
+
+        ev.add(body);
     }
+}
 
-    if (stderr_pipe_capturer) stderr_pipe_capturer->parent();
-    if (stdout_pipe_capturer) stdout_pipe_capturer->parent();
 
+// With run.json_lines, complete lines holding a JSON object are uploaded as
+// "da": {"json": {...}} entries so they aren't escaped a second time. Checking the
+// outer braces first means ordinary lines cost little more than finding their ends.
+// Key order and spacing aren't kept, but that changes only the formatting. When
+// parsing loses part of what the line says, lossy is set and the line is also
+// uploaded as "raw".
 
-    logp::event curr_event(timer, ws_worker);
+// Numbers that a double (or a 64-bit integer) can't hold are rounded by parsing,
+// and -0 loses its sign. p..p+len must be valid JSON.
+static bool json_numbers_lossy(const char *p, size_t len) {
+    const char *end = p + len;
 
-    curr_event.on_flushed = [&](){
-        run_msg_websocket_flushed m;
-        cmd_run_queue.push_move(m);
+    while (p < end) {
+        char c = *p;
+
+        if (c == '"') {
+            for (p++; p < end && *p != '"'; p++) {
+                if (*p == '\\') p++;
+            }
+            p++;
+            continue;
+        }
+
+        if (c != '-' && !isdigit(static_cast<unsigned char>(c))) {
+            p++;
+            continue;
+        }
+
+        const char *start = p;
+        bool fractional = false;
+        bool exponent = false;
+        size_t significant = 0, zeros = 0;
+
+        for (; p < end && (isdigit(static_cast<unsigned char>(*p)) || strchr("+-.eE", *p)); p++) {
+            if (*p == '.') fractional = true;
+            else if (*p == 'e' || *p == 'E') fractional = exponent = true;
+            else if (exponent || !isdigit(static_cast<unsigned char>(*p))) continue;
+            else if (*p == '0') zeros++; // only significant if another digit follows
+            else if (significant) significant += zeros + 1, zeros = 0;
+            else significant = 1, zeros = 0;
+        }
+
+        if (fractional) {
+            // What nlohmann::json prints floats with
+            if (significant > std::numeric_limits<double>::digits10) return true;
+        } else {
+            std::string num(start, p);
+            errno = 0;
+            if (num[0] == '-') strtoll(num.c_str(), nullptr, 10);
+            else strtoull(num.c_str(), nullptr, 10);
+            if (errno == ERANGE || num == "-0") return true;
+        }
+    }
+
+    return false;
+}
+
+static bool parse_json_line(const char *p, size_t len, nlohmann::json &out, bool &lossy) {
+    while (len && isspace(static_cast<unsigned char>(p[len - 1]))) len--;
+    while (len && isspace(static_cast<unsigned char>(*p))) p++, len--;
+
+    if (len < 2 || p[0] != '{' || p[len - 1] != '}') return false;
+
+    // A repeated key keeps only its last value
+    std::vector<std::vector<std::string>> keys;
+    bool duplicate_keys = false;
+
+    auto cb = [&](int, nlohmann::json::parse_event_t event, nlohmann::json &parsed){
+        if (event == nlohmann::json::parse_event_t::object_start) {
+            keys.emplace_back();
+        } else if (event == nlohmann::json::parse_event_t::object_end) {
+            keys.pop_back();
+        } else if (event == nlohmann::json::parse_event_t::key) {
+            auto &k = parsed.get_ref<const std::string &>();
+            auto &seen = keys.back();
+            if (std::find(seen.begin(), seen.end(), k) != seen.end()) duplicate_keys = true;
+            else seen.push_back(k);
+        }
+
+        return true;
     };
 
-    PRINT_INFO << "Executing " << my_argv[optind] << " (pid " << fork_ret << ")";
+    try {
+        out = nlohmann::json::parse(p, p + len, cb);
+    } catch (std::exception &) {
+        return false;
+    }
 
+    if (!out.is_object()) return false;
 
-    {
-        nlohmann::json data;
+    lossy = duplicate_keys || json_numbers_lossy(p, len);
 
-        {
-            data["type"] = "cmd";
+    return true;
+}
 
-            for (char **a = my_argv+optind; *a; a++) data["cmd"].push_back(*a);
+static void add_json_lines_chunk(logp::event &ev, captured_stream &st, logp::capture_chunk &c) {
+    logp::capture_chunk text;
+    size_t text_start = 0;
+    size_t next_repeat = 0;
+    size_t group = 0;
+    uint64_t used_in_group = 0;
+    nlohmann::json obj;
 
-            char hostname[256];
-            if (!gethostname(hostname, sizeof(hostname))) {
-                data["hostname"] = hostname;
-            } else {
-                PRINT_ERROR << "Couldn't determine hostname: " << strerror(errno);
-            }
+    text.timestamp = c.timestamp;
 
-            struct passwd *pw = getpwuid(geteuid());
+    // Moves what has accumulated before data offset end into its own entry
+    auto flush_text = [&](size_t end) {
+        text.data.assign(c.data, text_start, end - text_start);
 
-            if (pw) data["user"] = pw->pw_name;
+        for (; next_repeat < c.repeats.size() && c.repeats[next_repeat].offset <= end; next_repeat++) {
+            text.repeats.push_back(c.repeats[next_repeat]);
+            text.repeats.back().offset -= text_start;
+        }
 
-            data["pid"] = fork_ret;
-            data["ppid"] = ppid;
+        add_text_chunk(ev, st, text);
 
-            auto vars_to_capture = conf.get_strvec("run.env");
+        text = logp::capture_chunk();
+    };
 
-            if (vars_to_capture.size()) {
-                for (char **envp = environ; *envp; envp++) {
-                    std::string env_kv = std::string(*envp);
+    for (size_t pos = 0; pos < c.data.size(); ) {
+        size_t newline = c.data.find('\n', pos);
+        if (newline == std::string::npos) break; // a partial line can't be checked
 
-                    auto equal_sign_pos = env_kv.find_first_of('=');
-                    if (equal_sign_pos == std::string::npos) continue;
+        uint64_t line_timestamp = group < c.lines.size() ? c.lines[group].timestamp : c.timestamp;
+        if (group < c.lines.size() && ++used_in_group == c.lines[group].count) group++, used_in_group = 0;
 
-                    std::string env_k = env_kv.substr(0, equal_sign_pos);
+        bool lossy = false;
 
-                    bool match = false;
+        if (parse_json_line(c.data.data() + pos, newline - pos, obj, lossy)) {
+            flush_text(pos);
 
-                    for (auto v : vars_to_capture) {
-                        if (::fnmatch(v.c_str(), env_k.c_str(), 0) == 0) {
-                            match = true;
-                            break;
-                        }
-                    }
+            nlohmann::json body = {{ "ty", st.type }, { "at", line_timestamp }};
+            if (lossy) body["da"]["raw"] = c.data.substr(pos, newline - pos);
+            body["da"]["json"] = std::move(obj);
+            ev.add(body);
 
-                    if (match) data["env"][env_k] = env_kv.substr(equal_sign_pos+1);
-                }
-            }
+            text.timestamp = line_timestamp;
+            text_start = newline + 1;
+        } else if (c.lines.size()) {
+            if (text_start == pos && !text.lines.size()) text.timestamp = line_timestamp;
 
-            if (opt_tag.size()) data["tag"] = opt_tag;
+            if (text.lines.size() && text.lines.back().timestamp == line_timestamp) text.lines.back().count++;
+            else text.lines.push_back({ 1, line_timestamp });
         }
 
-        {
-            nlohmann::json body = {{ "ty", "cmd" }, { "st", start_timestamp }, { "da", data }, { "hb", conf.get_uint64("run.heartbeat", 5000000) }};
-            curr_event.start(body);
-        }
+        pos = newline + 1;
     }
 
+    flush_text(c.data.size());
+}
 
 
-    bool pid_exited = false;
-    uint64_t end_timestamp = 0;
-    bool sent_end_message = false;
-    int wait_status = 0;
-    struct rusage resource_usage = {};
+static void add_captured_chunk(logp::event &ev, captured_stream &st, logp::capture_chunk &c) {
+    if (c.elided) {
+        nlohmann::json body = {{ "ty", st.type }, { "at", c.timestamp }, { "da", { { "elided", c.elided } } }};
+        ev.add(body);
+    }
 
-    uint64_t next_evpid = 1;
-    std::unordered_map<int, uint64_t> pid_to_evpid;
+    if (st.json_lines) add_json_lines_chunk(ev, st, c);
+    else add_text_chunk(ev, st, c);
+}
 
-    while (1) {
-        auto mv = cmd_run_queue.shift();
 
-        mv.match([&](run_msg_sigchld &){
-            uint64_t now = logp::util::curr_time();
+// "da" of the cmd entry that starts a job's event
 
-            int my_status;
-            pid_t wait_ret = wait4(fork_ret, &my_status, WNOHANG, &resource_usage);
-            if (wait_ret <= 0) {
-                PRINT_WARNING << "Received error from wait4: " << strerror(errno);
-                return;
-            }
+nlohmann::json run::job_start_data(const std::vector<std::string> &cmd, pid_t pid, pid_t ppid) {
+    nlohmann::json data;
 
-            if (wait_ret == fork_ret) {
-                end_timestamp = now;
-                wait_status = my_status;
-                pid_exited = true;
-
-                PRINT_INFO << "Process exited (" <<
-                    (WIFEXITED(wait_status) ? (std::string("status ") + std::to_string(WEXITSTATUS(wait_status)))
-                     : WIFSIGNALED(wait_status) ? (std::string("signal ") + std::to_string(WTERMSIG(wait_status)))
-                     : "other")
-                    << ")"
-                ;
-
-                kill_timeout_normal_shutdown = true;
-                kill_signal_handler();
-            } else {
-                PRINT_WARNING << "Received success from wait4 for a different process: " << wait_ret;
-            }
-        },
-        [&](run_msg_websocket_flushed &){
-            exit(WEXITSTATUS(wait_status));
-        },
-        [&](run_msg_pipe_data &m){
-            if (m.fd == 2 && stderr_pipe_capturer) {
-                if (m.data.size()) {
-                    nlohmann::json body = {{ "ty", "stderr" }, { "at", m.timestamp }, { "da", { { "txt", m.data } } }};
-                    curr_event.add(body);
-                }
+    data["type"] = "cmd";
 
-                if (m.finished) {
-                    stderr_finished = true;
-                }
-            } else if (m.fd == 1 && stdout_pipe_capturer) {
-                if (m.data.size()) {
-                    nlohmann::json body = {{ "ty", "stdout" }, { "at", m.timestamp }, { "da", { { "txt", m.data } } }};
-                    curr_event.add(body);
-                }
+    for (auto &a : cmd) data["cmd"].push_back(a);
+
+    char hostname[256];
+    if (!gethostname(hostname, sizeof(hostname))) {
+        data["hostname"] = hostname;
+    } else {
+        PRINT_ERROR << "Couldn't determine hostname: " << strerror(errno);
+    }
+
+    struct passwd *pw = getpwuid(geteuid());
+
+    if (pw) data["user"] = pw->pw_name;
+
+    data["pid"] = pid;
+    data["ppid"] = ppid;
+
+    auto vars_to_capture = conf.get_strvec("run.env");
+
+    if (vars_to_capture.size()) {
+        for (char **envp = environ; *envp; envp++) {
+            std::string env_kv = std::string(*envp);
+
+            auto equal_sign_pos = env_kv.find_first_of('=');
+            if (equal_sign_pos == std::string::npos) continue;
 
-                if (m.finished) {
-                    stdout_finished = true;
+            std::string env_k = env_kv.substr(0, equal_sign_pos);
+
+            bool match = false;
+
+            for (auto v : vars_to_capture) {
+                if (::fnmatch(v.c_str(), env_k.c_str(), 0) == 0) {
+                    match = true;
+                    break;
                 }
             }
-        },
-        [&](run_msg_proc_started &m){
-            auto evpid = next_evpid++;
-            pid_to_evpid[m.data["pid"]] = evpid;
-            m.data["evpid"] = evpid;
-            if (pid_to_evpid.count(m.data["ppid"])) {
-                m.data["evppid"] = pid_to_evpid[m.data["ppid"]];
-            }
-            m.data["what"] = "start";
-            nlohmann::json body = {{ "ty", "proc" }, { "at", m.timestamp }, { "da", m.data }};
-            curr_event.add(body);
-        },
-        [&](run_msg_proc_exited &m){
-            if (pid_to_evpid.count(m.data["pid"])) {
-                m.data["evpid"] = pid_to_evpid[m.data["pid"]];
-            }
-            m.data["what"] = "end";
-            nlohmann::json body = {{ "ty", "proc" }, { "at", m.timestamp }, { "da", m.data }};
-            curr_event.add(body);
+
+            if (match) data["env"][env_k] = env_kv.substr(equal_sign_pos+1);
         }
-        );
+    }
 
-        if (pid_exited && (!stderr_pipe_capturer || stderr_finished) && (!stdout_pipe_capturer || stdout_finished) && !sent_end_message) {
-            nlohmann::json data;
+    if (opt_tag.size()) data["tag"] = opt_tag;
 
-            if (WIFEXITED(wait_status)) {
-                data["term"] = "exit";
-                data["exit"] = WEXITSTATUS(wait_status);
-            } else if (WIFSIGNALED(wait_status)) {
-                data["term"] = "signal";
-                data["signal"] = strsignal(WTERMSIG(wait_status));
-                if (WCOREDUMP(wait_status)) data["core"] = true;
-            } else {
-                data["term"] = "unknown";
-            }
+    return data;
+}
+
+
+// "da" of the cmd entry that ends a job's event, from its wait status
+
+static nlohmann::json job_end_data(int wait_status, struct rusage &resource_usage) {
+    nlohmann::json data;
+
+    if (WIFEXITED(wait_status)) {
+        data["term"] = "exit";
+        data["exit"] = WEXITSTATUS(wait_status);
+    } else if (WIFSIGNALED(wait_status)) {
+        data["term"] = "signal";
+        data["signal"] = strsignal(WTERMSIG(wait_status));
+        if (WCOREDUMP(wait_status)) data["core"] = true;
+    } else {
+        data["term"] = "unknown";
+    }
 
-            long ru_maxrss = resource_usage.ru_maxrss;
+    long ru_maxrss = resource_usage.ru_maxrss;
 
 #ifdef __APPLE__
-            ru_maxrss /= 1024; // In bytes on OS X
+    ru_maxrss /= 1024; // In bytes on OS X
 #endif
 
-            data["rusage"]["utime"] = logp::util::timeval_to_usecs(resource_usage.ru_utime);
-            data["rusage"]["stime"] = logp::util::timeval_to_usecs(resource_usage.ru_stime);
-            data["rusage"]["maxrss"] = ru_maxrss;
-            data["rusage"]["minflt"] = resource_usage.ru_minflt;
-            data["rusage"]["majflt"] = resource_usage.ru_majflt;
-            data["rusage"]["inblock"] = resource_usage.ru_inblock;
-            data["rusage"]["oublock"] = resource_usage.ru_oublock;
-            data["rusage"]["nvcsw"] = resource_usage.ru_nvcsw;
-            data["rusage"]["nivcsw"] = resource_usage.ru_nivcsw;
+    data["rusage"]["utime"] = logp::util::timeval_to_usecs(resource_usage.ru_utime);
+    data["rusage"]["stime"] = logp::util::timeval_to_usecs(resource_usage.ru_stime);
+    data["rusage"]["maxrss"] = ru_maxrss;
+    data["rusage"]["minflt"] = resource_usage.ru_minflt;
+    data["rusage"]["majflt"] = resource_usage.ru_majflt;
+    data["rusage"]["inblock"] = resource_usage.ru_inblock;
+    data["rusage"]["oublock"] = resource_usage.ru_oublock;
+    data["rusage"]["nvcsw"] = resource_usage.ru_nvcsw;
+    data["rusage"]["nivcsw"] = resource_usage.ru_nivcsw;
+
+    return data;
+}
 
-            nlohmann::json body = {{ "ty", "cmd" }, { "en", end_timestamp }, { "da", data }};
-            curr_event.end(body);
 
-            sent_end_message = true;
-        }
-    }
+static logp::capture_options load_capture_options() {
+    logp::capture_options capture_opts;
+
+    capture_opts.passthrough_policy = logp::passthrough_writer::parse_policy(::conf.get_str("run.passthrough", "block"));
+    capture_opts.passthrough_buffer = ::conf.get_uint64("run.passthrough_buffer", capture_opts.passthrough_buffer);
+    capture_opts.flush_min_delay = ::conf.get_uint64("run.flush_min_delay", capture_opts.flush_min_delay);
+    capture_opts.flush_max_delay = ::conf.get_uint64("run.flush_max_delay", capture_opts.flush_max_delay);
+    capture_opts.flush_bytes = ::conf.get_uint64("run.flush_bytes", capture_opts.flush_bytes);
+    capture_opts.flush_newline = ::conf.get_bool("run.flush_newline", capture_opts.flush_newline);
+    if (capture_opts.flush_min_delay > capture_opts.flush_max_delay) capture_opts.flush_min_delay = capture_opts.flush_max_delay;
+    if (!capture_opts.flush_bytes) throw logp::error("run.flush_bytes must be greater than 0");
+    capture_opts.head_bytes = ::conf.get_uint64("run.head_bytes", 0);
+    capture_opts.tail_bytes = ::conf.get_uint64("run.tail_bytes", 0);
+    capture_opts.lines = ::conf.get_bool("run.lines", false);
+    capture_opts.collapse = parse_collapse_mode(::conf.get_str("run.collapse", "none"));
+
+    return capture_opts;
+}
+
+
+// run.follow_* filters, passed to logp_preload.so in its environment
+
+static std::vector<std::pair<std::string, std::string>> load_follow_filter_env() {
+    std::vector<std::pair<std::string, std::string>> env;
+
+    auto add_globs = [&](std::string name, std::string var){
+        std::string list;
+        for (auto &g : ::conf.get_strvec(name)) {
+            if (g.find(':') != std::string::npos) throw logp::error(name, " patterns can't contain ':'");
+            if (list.size()) list += ":";
+            list += g;
+        }
+        if (list.size()) env.emplace_back(var, list);
+    };
+
+    add_globs("run.follow_include", "LOGP_FOLLOW_INCLUDE");
+    add_globs("run.follow_exclude", "LOGP_FOLLOW_EXCLUDE");
+
+    std::string max_depth = ::conf.get_str("run.follow_max_depth", "");
+    if (max_depth.size()) {
+        char *end;
+        errno = 0;
+        unsigned long long depth = strtoull(max_depth.c_str(), &end, 10);
+        if (*end || errno || !isdigit(static_cast<unsigned char>(max_depth[0]))) throw logp::error("run.follow_max_depth must be a number, not '", max_depth, "'");
+
+        env.emplace_back("LOGP_FOLLOW_MAX_DEPTH", std::to_string(depth));
+        env.emplace_back("LOGP_FOLLOW_DEPTH", "0:-1"); // the job itself is depth 0
+    }
+
+    std::string sample = ::conf.get_str("run.follow_sample", "");
+    if (sample.size()) {
+        char *end;
+        double fraction = strtod(sample.c_str(), &end);
+        if (*end || end == sample.c_str() || !(fraction >= 0 && fraction <= 1)) throw logp::error("run.follow_sample must be between 0 and 1, not '", sample, "'");
+        env.emplace_back("LOGP_FOLLOW_SAMPLE", sample);
+    }
+
+    return env;
+}
+
+
+void run::execute() {
+    if (opt_manifest.size()) {
+        if (my_argv[optind]) throw logp::error("a command can't be given with --manifest");
+        execute_parallel();
+        return;
+    }
+
+    if (opt_jobs) throw logp::error("-j only applies with --manifest");
+
+    phase_timings timings;
+    timings.enabled = opt_timings || ::conf.get_bool("run.timings", false);
+    timings.mark("options parsed");
+
+    if (!my_argv[optind]) {
+        PRINT_ERROR << "Must provide a command after run, ie 'logp run sleep 10'";
+        print_usage_and_exit();
+    }
+
+    std::unordered_set<int> inherited_fds;
+    int max_capture_fd = 2;
+
+    for (auto &c : opt_capture_fds) {
+        if (fcntl(c.first, F_GETFD) != -1) inherited_fds.insert(c.first);
+        max_capture_fd = std::max(max_capture_fd, c.first);
+    }
+
+    config_stderr = ::conf.get_bool("run.stderr", true);
+    config_stdout = ::conf.get_bool("run.stdout", true);
+    config_follow = parse_follow_mode(opt_follow.size() ? opt_follow : ::conf.get_str("run.follow", "preload"));
+    if (config_follow == "proc" && !logp::proc_watcher::supported()) throw logp::error("follow mode proc needs /proc/<pid>/task/<tid>/children (Linux 3.5+)");
+    if (config_follow == "ptrace" && !logp::ptrace_watcher::supported()) throw logp::error("follow mode ptrace is only supported on Linux");
+    config_pty = opt_pty || ::conf.get_bool("run.pty", false);
+    config_sample = opt_sample || ::conf.get_bool("run.sample", false);
+    if (config_sample && !logp::proc_sampler::supported()) throw logp::error("resource sampling needs /proc");
+    config_perf = opt_perf || ::conf.get_bool("run.perf", false);
+    if (config_perf && !logp::perf_counters::supported()) throw logp::error("perf counters are only supported on Linux");
+    config_detach = opt_detach || ::conf.get_bool("run.detach", false);
+    if (config_detach && config_pty) throw logp::error("--detach can't be used with --pty");
+
+    logp::capture_options capture_opts = load_capture_options();
+
+    bool config_json_lines = ::conf.get_bool("run.json_lines", false);
+    if (config_json_lines) capture_opts.flush_newline = true; // lines must not be split across chunks
+    capture_opts.min_internal_fd = max_capture_fd + 1;
+
+    bool config_compress = ::conf.get_bool("run.compress", false);
+    int config_compress_level = static_cast<int>(::conf.get_uint64("run.compress_level", 6));
+    if (config_compress_level > 9) throw logp::error("run.compress_level must be between 0 and 9");
+
+    uint64_t config_rate_limit = ::conf.get_uint64("run.rate_limit", 0);
+    output_rate_limiter rate_limiter(config_rate_limit, ::conf.get_uint64("run.rate_burst", config_rate_limit));
+
+    bool config_follow_ring = false;
+    std::vector<std::pair<std::string, std::string>> follow_filter_env; // evaluated by logp_preload.so
+    std::string logp_preload_path;
+
+    if (config_follow == "preload") {
+        std::string transport = ::conf.get_str("run.follow_transport", "ring");
+        if (transport != "ring" && transport != "socket") throw logp::error("unknown run.follow_transport '", transport, "' (expected ring or socket)");
+        config_follow_ring = transport == "ring";
+
+        follow_filter_env = load_follow_filter_env();
+        logp_preload_path = find_logp_preload();
+    }
+
+    pid_t ppid = getppid();
+
+    timings.mark("config read");
+
+    // Before any threads are started
+    logp::detacher detacher;
+    if (config_detach) detacher.start();
+
+
+    hoytech::protected_queue<run_msg> cmd_run_queue;
+
+
+    struct sigaction sa;
+    sa.sa_handler = [](int){};
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, nullptr);
+
+    logp::signal_watcher sigwatcher;
+
+    sigwatcher.subscribe(SIGCHLD, [&](){
+        run_msg_sigchld m;
+        cmd_run_queue.push_move(m);
+    });
+
+    logp::preload_watcher preloadwatcher;
+    logp::proc_watcher procwatcher;
+    logp::ptrace_watcher ptracewatcher;
+    logp::proc_sampler procsampler;
+
+    hoytech::timer timer;
+
+    bool kill_timeout_normal_shutdown = false;
+    bool kill_timeout_timer_started = false;
+    uint64_t kill_timeout = 4*1000000;
+
+    auto kill_signal_handler = [&](){
+        if (kill_timeout_timer_started) return;
+        kill_timeout_timer_started = true;
+
+        if (!kill_timeout_normal_shutdown) PRINT_WARNING << "attempting to communicate with log periodic server, please wait...";
+
+        timer.once(kill_timeout, []{
+            PRINT_ERROR << "was unable to communicate with log periodic server";
+            exit(1);
+        });
+    };
+
+    sigwatcher.subscribe(SIGHUP, kill_signal_handler);
+    sigwatcher.subscribe(SIGINT, kill_signal_handler);
+    sigwatcher.subscribe(SIGQUIT, kill_signal_handler);
+    sigwatcher.subscribe(SIGTERM, kill_signal_handler);
+
+    std::unique_ptr<logp::pty> job_pty;
+
+    if (config_pty) {
+        job_pty = std::unique_ptr<logp::pty>(new logp::pty());
+
+        sigwatcher.subscribe(SIGWINCH, [&](){
+            job_pty->resize();
+        });
+    }
+
+
+
+
+    preloadwatcher.on_proc_start = procwatcher.on_proc_start = ptracewatcher.on_proc_start = [&](uint64_t ts, nlohmann::json &data){
+        run_msg_proc_started m{ts, std::move(data)};
+        cmd_run_queue.push_move(m);
+    };
+
+    preloadwatcher.on_proc_end = procwatcher.on_proc_end = ptracewatcher.on_proc_end = [&](uint64_t ts, nlohmann::json &data){
+        run_msg_proc_exited m{ts, std::move(data)};
+        cmd_run_queue.push_move(m);
+    };
+
+    ptracewatcher.on_root_exit = [&](uint64_t ts, int status, struct rusage &ru){
+        run_msg_job_exited m{ts, status, ru};
+        cmd_run_queue.push_move(m);
+    };
+
+    procsampler.on_samples = [&](uint64_t ts, nlohmann::json &data){
+        run_msg_proc_samples m{ts, std::move(data)};
+        cmd_run_queue.push_move(m);
+    };
+
+
+
+
+    std::vector<captured_stream> streams;
+
+    auto add_stream = [&](std::string type, std::function<std::unique_ptr<logp::pipe_capturer>(std::function<void(logp::capture_chunk &)>, std::function<void()>)> make_capturer){
+        size_t index = streams.size();
+
+        streams.emplace_back();
+        streams.back().type = type;
+        streams.back().json_lines = config_json_lines;
+        if (config_compress) streams.back().compressor = std::unique_ptr<logp::deflate_stream>(new logp::deflate_stream(config_compress_level));
+        streams.back().capturer = make_capturer(
+            [&, index](logp::capture_chunk &c){
+                run_msg_pipe_data m;
+                m.stream = index;
+                m.chunk = std::move(c);
+                cmd_run_queue.push_move(m);
+            },
+            [&, index](){
+                run_msg_pipe_data m;
+                m.stream = index;
+                m.finished = true;
+                cmd_run_queue.push_move(m);
+            }
+        );
+    };
+
+    auto add_fd_stream = [&](int fd, int passthrough_fd, std::string type){
+        add_stream(type, [&](std::function<void(logp::capture_chunk &)> data_cb, std::function<void()> end_cb){
+            return std::unique_ptr<logp::pipe_capturer>(new logp::pipe_capturer(fd, passthrough_fd, timer, capture_opts, data_cb, end_cb));
+        });
+    };
+
+    if (job_pty) {
+        // Everything written to the terminal is one stream
+        int master_fd = dup(job_pty->get_master_fd());
+        if (master_fd == -1) throw logp::error("unable to dup pty master: ", strerror(errno));
+
+        add_stream("stdout", [&](std::function<void(logp::capture_chunk &)> data_cb, std::function<void()> end_cb){
+            return logp::pipe_capturer::adopt(master_fd, 1, timer, capture_opts, data_cb, end_cb);
+        });
+    } else {
+        if (config_stderr) add_fd_stream(2, 2, "stderr");
+        if (config_stdout) add_fd_stream(1, 1, "stdout");
+    }
+
+    for (auto &c : opt_capture_fds) {
+        // Only pass through to descriptors we inherited, not ones logp itself has opened
+        add_fd_stream(c.first, inherited_fds.count(c.first) ? c.first : -1, c.second);
+    }
+
+    // Creating and opening FIFOs can fail, which must happen before any threads
+    // are running. The capturers' own threads only start in parent().
+    for (auto &c : opt_capture_fifos) {
+        add_stream(c.second, [&](std::function<void(logp::capture_chunk &)> data_cb, std::function<void()> end_cb){
+            return std::unique_ptr<logp::pipe_capturer>(new logp::pipe_capturer(c.first, timer, capture_opts, data_cb, end_cb));
+        });
+    }
+
+
+    timings.mark("output capture set up");
+
+
+
+    // Blocks the signals in this thread, so it must come before the others are started
+    sigwatcher.run();
+
+    // Then, so that connecting overlaps the rest of the setup
+    logp::websocket::worker ws_worker;
+
+    ws_worker.run();
+
+    timings.mark("connection started");
+
+    timer.run();
+
+    if (config_follow == "preload") {
+        preloadwatcher.use_ring = config_follow_ring;
+        preloadwatcher.run();
+    }
+
+
+    timings.mark("watchers started");
+
+
+    uint64_t start_timestamp = logp::util::curr_time();
+
+    if (config_follow == "ptrace") ptracewatcher.prepare();
+
+    logp::job_cgroup jobcgroup;
+    bool have_cgroup = ::conf.get_bool("run.cgroup", true) && jobcgroup.create();
+
+    logp::perf_counters perfcounters;
+    if (config_perf) perfcounters.prepare();
+
+    timings.mark("job environment prepared");
+
+    pid_t fork_ret = fork();
+
+    if (fork_ret == -1) {
+        PRINT_ERROR << "unable to fork: " << strerror(errno);
+        _exit(1);
+    } else if (fork_ret == 0) {
+        if (job_pty) job_pty->child();
+        for (auto &st : streams) st.capturer->child();
+
+        if (config_follow == "preload") {
+            ::setenv("LOGP_SOCKET_PATH", preloadwatcher.get_socket_path().c_str(), 0);
+            if (preloadwatcher.get_socket_path() == ::getenv("LOGP_SOCKET_PATH")) {
+                // Not when nested inside another logp run that reports to its own socket
+                if (preloadwatcher.get_ring_path().size()) ::setenv("LOGP_RING_PATH", preloadwatcher.get_ring_path().c_str(), 0);
+                if (preloadwatcher.get_pidfd_supported()) ::setenv("LOGP_PIDFD", "1", 0);
+                for (auto &e : follow_filter_env) ::setenv(e.first.c_str(), e.second.c_str(), 1);
+            }
+            const char *logp_preload_env_var;
+
+#ifdef __APPLE__
+            logp_preload_env_var = "DYLD_INSERT_LIBRARIES";
+#else
+            logp_preload_env_var = "LD_PRELOAD";
+#endif
+
+            if (logp_preload_path.size()) ::setenv(logp_preload_env_var, logp_preload_path.c_str(), 0);
+        }
+
+        jobcgroup.child();
+        sigwatcher.unblock();
+        if (config_perf) perfcounters.child();
+        if (config_follow == "ptrace") ptracewatcher.child();
+        execvp(my_argv[optind], my_argv+optind);
+        PRINT_ERROR << "Couldn't exec " << my_argv[optind] << " : " << strerror(errno);
+        _exit(1);
+    }
+
+    if (config_perf) perfcounters.open(fork_ret);
+
+    for (auto &st : streams) st.capturer->parent();
+    if (!jobcgroup.parent()) have_cgroup = false;
+    if (job_pty) job_pty->parent();
+
+    timings.mark("job forked");
+
+    if (config_follow == "proc") {
+        procwatcher.min_interval = ::conf.get_uint64("run.follow_poll_min", procwatcher.min_interval);
+        procwatcher.max_interval = ::conf.get_uint64("run.follow_poll_max", procwatcher.max_interval);
+        procwatcher.run(fork_ret);
+    } else if (config_follow == "ptrace") {
+        ptracewatcher.run(fork_ret);
+    }
+
+    if (config_sample) {
+        procsampler.interval = ::conf.get_uint64("run.sample_interval", procsampler.interval);
+        procsampler.batch = std::max(::conf.get_uint64("run.sample_batch", procsampler.batch), (uint64_t)1);
+        procsampler.run(fork_ret);
+    }
+
+
+    logp::event curr_event(timer, ws_worker);
+
+    curr_event.on_flushed = [&](){
+        run_msg_websocket_flushed m;
+        cmd_run_queue.push_move(m);
+    };
+
+    PRINT_INFO << "Executing " << my_argv[optind] << " (pid " << fork_ret << ")";
+
+
+    {
+        std::vector<std::string> cmd;
+        for (char **a = my_argv+optind; *a; a++) cmd.push_back(*a);
+
+        nlohmann::json data = job_start_data(cmd, fork_ret, ppid);
+
+        {
+            nlohmann::json body = {{ "ty", "cmd" }, { "st", start_timestamp }, { "da", data }, { "hb", conf.get_uint64("run.heartbeat", 5000000) }};
+            curr_event.start(body);
+        }
+    }
+
+    timings.mark("start entry queued");
+
+
+
+    bool pid_exited = false;
+    uint64_t end_timestamp = 0;
+    bool sent_end_message = false;
+    uint64_t sample_batches_added = 0;
+    int wait_status = 0;
+    struct rusage resource_usage = {};
+
+    uint64_t next_evpid = 1;
+    std::unordered_map<int, uint64_t> pid_to_evpid;
+
+    std::unique_ptr<logp::proc_tree> proc_tree;
+
+    if (config_follow.size() && ::conf.get_bool("run.follow_profile", true)) {
+        proc_tree = std::unique_ptr<logp::proc_tree>(new logp::proc_tree(::conf.get_uint64("run.profile_top", 10), ::conf.get_uint64("run.profile_depth", 3)));
+    }
+
+    auto add_proc_start = [&](uint64_t ts, nlohmann::json &data){
+        auto evpid = next_evpid++;
+        pid_to_evpid[data["pid"]] = evpid;
+        data["evpid"] = evpid;
+        if (pid_to_evpid.count(data["ppid"])) {
+            data["evppid"] = pid_to_evpid[data["ppid"]];
+        }
+        data["what"] = "start";
+        if (proc_tree) proc_tree->started(ts, data);
+        nlohmann::json body = {{ "ty", "proc" }, { "at", ts }, { "da", data }};
+        curr_event.add(body);
+    };
+
+    auto add_proc_end = [&](uint64_t ts, nlohmann::json &data){
+        if (pid_to_evpid.count(data["pid"])) {
+            data["evpid"] = pid_to_evpid[data["pid"]];
+        }
+        data["what"] = "end";
+        if (proc_tree) proc_tree->ended(ts, data);
+        nlohmann::json body = {{ "ty", "proc" }, { "at", ts }, { "da", data }};
+        curr_event.add(body);
+    };
+
+    std::unique_ptr<logp::proc_aggregator> proc_agg;
+
+    if (config_follow.size() && ::conf.get_bool("run.follow_aggregate", false)) {
+        uint64_t min_runtime = ::conf.get_uint64("run.aggregate_min_runtime", 1000000);
+        uint64_t interval = ::conf.get_uint64("run.aggregate_interval", 5000000);
+
+        proc_agg = std::unique_ptr<logp::proc_aggregator>(new logp::proc_aggregator(min_runtime, interval));
+
+        proc_agg->on_start = add_proc_start;
+        proc_agg->on_end = add_proc_end;
+        proc_agg->on_rollup = [&](uint64_t ts, nlohmann::json &data){
+            if (data.count("ppid") && pid_to_evpid.count(data["ppid"])) {
+                data["evppid"] = pid_to_evpid[data["ppid"]];
+            }
+            if (proc_tree) proc_tree->rollup(ts, data);
+            nlohmann::json body = {{ "ty", "proc" }, { "at", ts }, { "da", data }};
+            curr_event.add(body);
+        };
+
+        timer.repeat(std::max(std::min(min_runtime, interval) / 2, (uint64_t)10000), [&]{
+            run_msg_proc_tick m;
+            cmd_run_queue.push_move(m);
+        });
+    }
+
+    auto job_exited = [&](uint64_t now, int status){
+        end_timestamp = now;
+        wait_status = status;
+        pid_exited = true;
+
+        timings.mark("job exited");
+
+        PRINT_INFO << "Process exited (" <<
+            (WIFEXITED(wait_status) ? (std::string("status ") + std::to_string(WEXITSTATUS(wait_status)))
+             : WIFSIGNALED(wait_status) ? (std::string("signal ") + std::to_string(WTERMSIG(wait_status)))
+             : "other")
+            << ")"
+        ;
+
+        for (auto &st : streams) st.capturer->release();
+
+        kill_timeout_normal_shutdown = true;
+        if (config_detach) kill_timeout = ::conf.get_uint64("run.detach_timeout", 60000000); // nobody is waiting
+        kill_signal_handler();
+    };
+
+    while (1) {
+        auto mv = cmd_run_queue.shift();
+
+        mv.match([&](run_msg_sigchld &){
+            if (config_follow == "ptrace") return; // the tracer reaps the job
+
+            uint64_t now = logp::util::curr_time();
+
+            int my_status;
+            pid_t wait_ret = wait4(fork_ret, &my_status, WNOHANG, &resource_usage);
+            if (wait_ret <= 0) {
+                PRINT_WARNING << "Received error from wait4: " << strerror(errno);
+                return;
+            }
+
+            if (wait_ret == fork_ret) {
+                job_exited(now, my_status);
+            } else {
+                PRINT_WARNING << "Received success from wait4 for a different process: " << wait_ret;
+            }
+        },
+        [&](run_msg_job_exited &m){
+            resource_usage = m.resource_usage;
+            job_exited(m.timestamp, m.status);
+        },
+        [&](run_msg_websocket_flushed &){
+            timings.mark("uploaded");
+            timings.print();
+            exit(WEXITSTATUS(wait_status));
+        },
+        [&](run_msg_pipe_data &m){
+            auto &st = streams.at(m.stream);
+            if (m.finished) st.finished = true;
+
+            rate_limit_chunk(rate_limiter, st, m.chunk, m.finished);
+            add_captured_chunk(curr_event, st, m.chunk);
+        },
+        [&](run_msg_proc_started &m){
+            if (config_sample && m.data.count("pid")) procsampler.add(m.data["pid"]);
+            if (proc_agg) proc_agg->started(m.timestamp, m.data);
+            else add_proc_start(m.timestamp, m.data);
+        },
+        [&](run_msg_proc_exited &m){
+            if (proc_agg) proc_agg->exited(m.timestamp, m.data);
+            else add_proc_end(m.timestamp, m.data);
+        },
+        [&](run_msg_proc_tick &){
+            if (proc_agg) proc_agg->tick(logp::util::curr_time());
+        },
+        [&](run_msg_proc_samples &m){
+            nlohmann::json body = {{ "ty", "proc" }, { "at", m.timestamp }, { "da", m.data }};
+            curr_event.add(body);
+            sample_batches_added++;
+        }
+        );
+
+        bool streams_finished = std::all_of(streams.begin(), streams.end(), [](captured_stream &st){ return st.finished; });
+
+        if (pid_exited && streams_finished && !sent_end_message) {
+            if (config_sample) {
+                procsampler.stop();
+
+                // Batches the sampler queued before it stopped go ahead of the end
+                if (sample_batches_added < procsampler.batches) continue;
+            }
+
+            timings.mark("output finished");
+
+            // The job's output has all been passed through
+            if (config_detach) {
+                timings.print();
+                detacher.detach(wait_status);
+            }
+
+            if (proc_agg) proc_agg->flush(logp::util::curr_time());
+
+            if (proc_tree) {
+                nlohmann::json body = {{ "ty", "proc" }, { "at", end_timestamp }, { "da", proc_tree->summary(end_timestamp) }};
+                curr_event.add(body);
+            }
+
+            if (config_sample) {
+                uint64_t ts = 0;
+                nlohmann::json samples = procsampler.take(ts);
+
+                if (!samples.is_null()) {
+                    nlohmann::json body = {{ "ty", "proc" }, { "at", ts }, { "da", samples }};
+                    curr_event.add(body);
+                }
+            }
+
+            nlohmann::json data = job_end_data(wait_status, resource_usage);
+
+            if (config_perf) data["perf"] = perfcounters.read();
+
+            // Unlike rusage, covers everything the job started
+            if (have_cgroup) {
+                data["cgroup"] = jobcgroup.stats();
+                jobcgroup.remove();
+            }
+
+            nlohmann::json body = {{ "ty", "cmd" }, { "en", end_timestamp }, { "da", data }};
+            curr_event.end(body);
+
+            timings.mark("end entry queued");
+
+            sent_end_message = true;
+        }
+    }
+}
+
+
+
+// Parallel mode: every command in a manifest runs as its own job with its own event,
+// all of them sharing one connection and this process's threads. A free slot goes
+// to the ready command with the longest chain of commands waiting on it, so that
+// dependency chains aren't left until the end.
+
+struct parallel_task {
+    enum class state { waiting, running, succeeded, failed, skipped };
+
+    std::string id; // only when given in the manifest
+    std::string cmd;
+    std::vector<std::string> after;
+    std::vector<size_t> dependents;
+    size_t unfinished = 0; // dependencies that haven't succeeded yet
+    uint64_t chain = 0; // longest chain of dependents
+    state st = state::waiting;
+    int wait_status = 0;
+    uint64_t start = 0;
+    uint64_t end = 0;
+};
+
+struct parallel_job {
+    pid_t pid = -1;
+    std::vector<captured_stream> streams;
+    std::unique_ptr<output_rate_limiter> rate_limiter;
+    std::unique_ptr<logp::event> ev;
+    bool exited = false;
+    bool sent_end_message = false;
+    int wait_status = 0;
+    struct rusage resource_usage = {};
+};
+
+struct parallel_msg_sigchld {
+};
+
+struct parallel_msg_interrupted {
+};
+
+struct parallel_msg_pipe_data {
+    size_t task = 0;
+    size_t stream = 0;
+    bool finished = false;
+    logp::capture_chunk chunk;
+};
+
+struct parallel_msg_flushed {
+    size_t task;
+};
+
+using parallel_msg = mapbox::util::variant<parallel_msg_sigchld, parallel_msg_interrupted, parallel_msg_pipe_data, parallel_msg_flushed>;
+
+
+static std::vector<parallel_task> read_manifest(const std::string &path) {
+    std::ifstream file;
+    std::istream *in = &std::cin;
+
+    if (path != "-") {
+        file.open(path);
+        if (!file) throw logp::error("unable to open manifest '", path, "': ", strerror(errno));
+        in = &file;
+    }
+
+    std::vector<parallel_task> tasks;
+    std::unordered_map<std::string, size_t> ids;
+    std::string line;
+    size_t line_no = 0;
+
+    while (std::getline(*in, line)) {
+        line_no++;
+
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') continue;
+
+        parallel_task t;
+
+        if (line[first] == '{') {
+            nlohmann::json j;
+
+            try {
+                j = nlohmann::json::parse(line);
+                if (!j.count("cmd") || !j["cmd"].is_string()) throw logp::error("needs a \"cmd\" string");
+                t.cmd = j["cmd"].get<std::string>();
+                if (j.count("id")) t.id = j["id"].get<std::string>();
+                if (j.count("after")) {
+                    for (auto &a : j["after"]) t.after.push_back(a.get<std::string>());
+                }
+            } catch (std::exception &e) {
+                throw logp::error("manifest line ", line_no, ": ", e.what());
+            }
+
+            if (t.id.size()) {
+                if (ids.count(t.id)) throw logp::error("manifest line ", line_no, ": duplicate id '", t.id, "'");
+                ids[t.id] = tasks.size();
+            }
+        } else {
+            t.cmd = line.substr(first);
+        }
+
+        tasks.push_back(std::move(t));
+    }
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        for (auto &a : tasks[i].after) {
+            auto it = ids.find(a);
+            if (it == ids.end()) throw logp::error("manifest: '", tasks[i].cmd, "' is after unknown id '", a, "'");
+            tasks[it->second].dependents.push_back(i);
+            tasks[i].unfinished++;
+        }
+    }
+
+    // Dependencies before dependents, which only covers every task if there is no cycle
+    std::vector<size_t> order;
+    std::vector<size_t> remaining;
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        remaining.push_back(tasks[i].unfinished);
+        if (!tasks[i].unfinished) order.push_back(i);
+    }
+
+    for (size_t k = 0; k < order.size(); k++) {
+        for (auto d : tasks[order[k]].dependents) {
+            if (--remaining[d] == 0) order.push_back(d);
+        }
+    }
+
+    if (order.size() != tasks.size()) throw logp::error("manifest dependencies have a cycle");
+
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        auto &t = tasks[*it];
+        for (auto d : t.dependents) t.chain = std::max(t.chain, tasks[d].chain + 1);
+    }
+
+    return tasks;
+}
+
+
+static std::string format_secs(uint64_t usecs) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.2fs", usecs / 1000000.0);
+    return buf;
+}
+
+
+void run::execute_parallel() {
+    if (opt_detach) throw logp::error("--detach can't be used with --manifest");
+    if (opt_pty) throw logp::error("--pty can't be used with --manifest");
+    if (opt_follow.size()) throw logp::error("--follow can't be used with --manifest");
+    if (opt_sample) throw logp::error("--sample can't be used with --manifest");
+    if (opt_perf) throw logp::error("--perf can't be used with --manifest");
+    if (opt_capture_fds.size()) throw logp::error("--capture-fd can't be used with --manifest");
+    if (opt_capture_fifos.size()) throw logp::error("--capture-fifo can't be used with --manifest");
+
+    std::vector<parallel_task> tasks = read_manifest(opt_manifest);
+
+    if (tasks.empty()) {
+        PRINT_WARNING << "manifest has no commands";
+        return;
+    }
+
+    uint64_t slots = opt_jobs ? opt_jobs : ::conf.get_uint64("run.jobs", std::max(std::thread::hardware_concurrency(), 1u));
+    if (!slots) throw logp::error("run.jobs must be at least 1");
+
+    config_stderr = ::conf.get_bool("run.stderr", true);
+    config_stdout = ::conf.get_bool("run.stdout", true);
+
+    logp::capture_options capture_opts = load_capture_options();
+
+    bool config_json_lines = ::conf.get_bool("run.json_lines", false);
+    if (config_json_lines) capture_opts.flush_newline = true; // lines must not be split across chunks
+
+    bool config_compress = ::conf.get_bool("run.compress", false);
+    int config_compress_level = static_cast<int>(::conf.get_uint64("run.compress_level", 6));
+    if (config_compress_level > 9) throw logp::error("run.compress_level must be between 0 and 9");
+
+    uint64_t config_rate_limit = ::conf.get_uint64("run.rate_limit", 0);
+    uint64_t config_rate_burst = ::conf.get_uint64("run.rate_burst", config_rate_limit);
+    uint64_t config_heartbeat = ::conf.get_uint64("run.heartbeat", 5000000);
+
+
+    hoytech::protected_queue<parallel_msg> queue;
+
+
+    struct sigaction sa;
+    sa.sa_handler = [](int){};
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, nullptr);
+
+    logp::signal_watcher sigwatcher;
+
+    sigwatcher.subscribe(SIGCHLD, [&](){
+        parallel_msg_sigchld m;
+        queue.push_move(m);
+    });
+
+    auto interrupt_handler = [&](){
+        parallel_msg_interrupted m;
+        queue.push_move(m);
+    };
+
+    sigwatcher.subscribe(SIGHUP, interrupt_handler);
+    sigwatcher.subscribe(SIGINT, interrupt_handler);
+    sigwatcher.subscribe(SIGQUIT, interrupt_handler);
+    sigwatcher.subscribe(SIGTERM, interrupt_handler);
+
+    hoytech::timer timer;
+
+    // Before any other thread is started, so they all have the signals blocked
+    sigwatcher.run();
+
+    logp::websocket::worker ws_worker;
+
+    ws_worker.run();
+
+    timer.run();
+
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (devnull == -1) throw logp::error("unable to open /dev/null: ", strerror(errno));
+
+    auto cmp = [&](size_t a, size_t b){
+        if (tasks[a].chain != tasks[b].chain) return tasks[a].chain < tasks[b].chain;
+        return a > b; // otherwise in manifest order
+    };
+
+    std::priority_queue<size_t, std::vector<size_t>, decltype(cmp)> ready(cmp);
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        if (!tasks[i].unfinished) ready.push(i);
+    }
+
+    std::unordered_map<size_t, std::unique_ptr<parallel_job>> jobs; // until their events are flushed
+    std::unordered_map<pid_t, size_t> pid_to_task;
+    uint64_t running = 0;
+    size_t done = 0;
+    bool interrupted = false;
+
+    uint64_t start_timestamp = logp::util::curr_time();
+    pid_t ppid = getppid();
+
+    auto start_task = [&](size_t i){
+        auto &t = tasks[i];
+
+        std::unique_ptr<parallel_job> job(new parallel_job);
+        job->rate_limiter = std::unique_ptr<output_rate_limiter>(new output_rate_limiter(config_rate_limit, config_rate_burst));
+
+        auto add_fd_stream = [&](int fd, std::string type){
+            size_t index = job->streams.size();
+
+            job->streams.emplace_back();
+            auto &st = job->streams.back();
+            st.type = type;
+            st.json_lines = config_json_lines;
+            if (config_compress) st.compressor = std::unique_ptr<logp::deflate_stream>(new logp::deflate_stream(config_compress_level));
+            st.capturer = std::unique_ptr<logp::pipe_capturer>(new logp::pipe_capturer(fd, fd, timer, capture_opts,
+                [&queue, i, index](logp::capture_chunk &c){
+                    parallel_msg_pipe_data m;
+                    m.task = i;
+                    m.stream = index;
+                    m.chunk = std::move(c);
+                    queue.push_move(m);
+                },
+                [&queue, i, index](){
+                    parallel_msg_pipe_data m;
+                    m.task = i;
+                    m.stream = index;
+                    m.finished = true;
+                    queue.push_move(m);
+                }
+            ));
+        };
+
+        if (config_stderr) add_fd_stream(2, "stderr");
+        if (config_stdout) add_fd_stream(1, "stdout");
+
+        t.start = logp::util::curr_time();
+
+        pid_t fork_ret = fork();
+
+        if (fork_ret == -1) {
+            PRINT_ERROR << "unable to fork: " << strerror(errno);
+            _exit(1);
+        } else if (fork_ret == 0) {
+            for (auto &st : job->streams) st.capturer->child();
+            dup2(devnull, 0);
+            sigwatcher.unblock();
+            execl("/bin/sh", "sh", "-c", t.cmd.c_str(), (char *)nullptr);
+            PRINT_ERROR << "Couldn't exec /bin/sh : " << strerror(errno);
+            _exit(1);
+        }
+
+        for (auto &st : job->streams) st.capturer->parent();
+
+        job->pid = fork_ret;
+        pid_to_task[fork_ret] = i;
+        t.st = parallel_task::state::running;
+        running++;
+
+        job->ev = std::unique_ptr<logp::event>(new logp::event(timer, ws_worker));
+
+        job->ev->on_flushed = [&queue, i](){
+            parallel_msg_flushed m{i};
+            queue.push_move(m);
+        };
+
+        PRINT_INFO << "Executing " << t.cmd << " (pid " << fork_ret << ")";
+
+        nlohmann::json data = job_start_data({ "/bin/sh", "-c", t.cmd }, fork_ret, ppid);
+        data["manifest"]["index"] = i;
+        if (t.id.size()) data["manifest"]["id"] = t.id;
+
+        nlohmann::json body = {{ "ty", "cmd" }, { "st", t.start }, { "da", data }, { "hb", config_heartbeat }};
+        job->ev->start(body);
+
+        jobs[i] = std::move(job);
+    };
+
+    std::function<void(size_t)> skip_dependents = [&](size_t i){
+        for (auto d : tasks[i].dependents) {
+            if (tasks[d].st != parallel_task::state::waiting) continue;
+            tasks[d].st = parallel_task::state::skipped;
+            done++;
+            skip_dependents(d);
+        }
+    };
+
+    auto fill_slots = [&](){
+        while (!interrupted && running < slots && !ready.empty()) {
+            size_t i = ready.top();
+            ready.pop();
+            start_task(i);
+        }
+    };
+
+    auto check_finished = [&](size_t i){
+        auto &job = *jobs.at(i);
+        if (!job.exited || job.sent_end_message) return;
+        if (!std::all_of(job.streams.begin(), job.streams.end(), [](captured_stream &st){ return st.finished; })) return;
+
+        auto &t = tasks[i];
+
+        nlohmann::json data = job_end_data(job.wait_status, job.resource_usage);
+        nlohmann::json body = {{ "ty", "cmd" }, { "en", t.end }, { "da", data }};
+        job.ev->end(body);
+        job.sent_end_message = true;
+
+        bool ok = WIFEXITED(job.wait_status) && WEXITSTATUS(job.wait_status) == 0;
+        t.st = ok ? parallel_task::state::succeeded : parallel_task::state::failed;
+        t.wait_status = job.wait_status;
+        running--;
+        done++;
+
+        if (ok) {
+            for (auto d : t.dependents) {
+                if (--tasks[d].unfinished == 0 && tasks[d].st == parallel_task::state::waiting) ready.push(d);
+            }
+        } else {
+            skip_dependents(i);
+        }
+
+        fill_slots();
+    };
+
+    fill_slots();
+
+    while (done < tasks.size() || jobs.size()) {
+        auto mv = queue.shift();
+
+        mv.match([&](parallel_msg_sigchld &){
+            uint64_t now = logp::util::curr_time();
+
+            while (1) {
+                int status;
+                struct rusage ru;
+                pid_t wait_ret = wait4(-1, &status, WNOHANG, &ru);
+                if (wait_ret <= 0) break;
+
+                auto it = pid_to_task.find(wait_ret);
+                if (it == pid_to_task.end()) continue;
+
+                size_t i = it->second;
+                pid_to_task.erase(it);
+
+                auto &job = *jobs.at(i);
+                job.exited = true;
+                job.wait_status = status;
+                job.resource_usage = ru;
+                tasks[i].end = now;
+
+                check_finished(i);
+            }
+        },
+        [&](parallel_msg_interrupted &){
+            if (interrupted) return;
+            interrupted = true;
+
+            // The running jobs got the signal too, so wait a little for them to be uploaded
+            PRINT_WARNING << "interrupted, not starting any more commands";
+
+            for (auto &t : tasks) {
+                if (t.st != parallel_task::state::waiting) continue;
+                t.st = parallel_task::state::skipped;
+                done++;
+            }
+
+            timer.once(4*1000000, []{
+                PRINT_ERROR << "was unable to communicate with log periodic server";
+                exit(1);
+            });
+        },
+        [&](parallel_msg_pipe_data &m){
+            auto &job = *jobs.at(m.task);
+            auto &st = job.streams.at(m.stream);
+            if (m.finished) st.finished = true;
+
+            rate_limit_chunk(*job.rate_limiter, st, m.chunk, m.finished);
+            add_captured_chunk(*job.ev, st, m.chunk);
+
+            check_finished(m.task);
+        },
+        [&](parallel_msg_flushed &m){
+            jobs.erase(m.task);
+        }
+        );
+    }
+
+    close(devnull);
+
+
+    uint64_t elapsed = logp::util::curr_time() - start_timestamp;
+    size_t succeeded = 0, failed = 0, skipped = 0;
+    std::vector<size_t> finished;
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        auto &t = tasks[i];
+
+        if (t.st == parallel_task::state::succeeded) succeeded++;
+        else if (t.st == parallel_task::state::failed) failed++;
+        else skipped++;
+
+        if (t.st == parallel_task::state::succeeded || t.st == parallel_task::state::failed) finished.push_back(i);
+    }
+
+    std::cerr << "logp: " << tasks.size() << " commands in " << format_secs(elapsed) << " (" << slots << " at a time): "
+              << succeeded << " succeeded, " << failed << " failed, " << skipped << " skipped" << std::endl;
+
+    for (auto i : finished) {
+        auto &t = tasks[i];
+        if (t.st != parallel_task::state::failed) continue;
+
+        std::cerr << "  failed (" << (WIFEXITED(t.wait_status) ? (std::string("status ") + std::to_string(WEXITSTATUS(t.wait_status)))
+                                      : WIFSIGNALED(t.wait_status) ? (std::string("signal ") + std::to_string(WTERMSIG(t.wait_status)))
+                                      : "other")
+                  << "): " << t.cmd << std::endl;
+    }
+
+    std::sort(finished.begin(), finished.end(), [&](size_t a, size_t b){ return tasks[a].end - tasks[a].start > tasks[b].end - tasks[b].start; });
+    if (finished.size() > 5) finished.resize(5);
+
+    if (finished.size() > 1) {
+        std::cerr << "  slowest:" << std::endl;
+        for (auto i : finished) std::cerr << "    " << format_secs(tasks[i].end - tasks[i].start) << "  " << tasks[i].cmd << std::endl;
+    }
+
+    exit(failed || skipped ? 1 : 0);
 }
 
 }}
@@ -1,9 +1,13 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <stdio.h>
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
 
 #include "nlohmann/json.hpp"
 #include "hoytech/protected_queue.h"
@@ -11,28 +15,38 @@
 #include "logp/cmd/tail.h"
 #include "logp/websocket.h"
 #include "logp/util.h"
+#include "logp/compress.h"
 
 
 namespace logp { namespace cmd {
 
 
 uint64_t opt_event_id = 0;
+bool opt_timestamps = false;
+bool opt_expand_repeats = false;
+std::vector<std::string> opt_types;
 
 
 const char *tail::usage() {
     static const char *u =
         "logp tail [options]\n"
-        "  -e/--event [event id]   Event to tail"
+        "  -e/--event [event id]   Event to tail\n"
+        "  -T/--timestamps         Prefix each line with the time it was output\n"
+        "  -x/--expand-repeats     Print lines collapsed by run.collapse instead of a count\n"
+        "  -y/--type [name]        Also print entries captured with run --capture-fd/--capture-fifo"
     ;
 
     return u;
 }
 
-const char *tail::getopt_string() { return "e:"; }
+const char *tail::getopt_string() { return "e:Txy:"; }
 
 struct option *tail::get_long_options() {
     static struct option opts[] = {
         {"event", required_argument, 0, 'e'},
+        {"timestamps", no_argument, 0, 'T'},
+        {"expand-repeats", no_argument, 0, 'x'},
+        {"type", required_argument, 0, 'y'},
         {0, 0, 0, 0}
     };
 
@@ -47,20 +61,196 @@ void tail::process_option(int arg, int, char *) {
       case 'e':
         opt_event_id = std::stoull(std::string(optarg));
         break;
+
+      case 'T':
+        opt_timestamps = true;
+        break;
+
+      case 'x':
+        opt_expand_repeats = true;
+        break;
+
+      case 'y':
+        opt_types.push_back(std::string(optarg));
+        break;
     };
 }
 
 
 
 
+static std::string render_line_time(uint64_t time_us) {
+    time_t time_s = time_us / 1000000;
+
+    struct tm timeres;
+    if (!localtime_r(&time_s, &timeres)) throw logp::error("error parsing time");
+
+    char buf[100];
+    size_t len = strftime(buf, sizeof(buf), "%b%d %H:%M:%S", &timeres);
+    snprintf(buf + len, sizeof(buf) - len, ".%03d", static_cast<int>((time_us / 1000) % 1000));
+
+    return std::string(buf);
+}
+
+
+// Entries captured with line framing have "ln": [[count, delta], ...] giving the time
+// each group of lines was read. Otherwise every line gets the entry's "at" time.
+
+class line_stamper {
+  public:
+    line_stamper(nlohmann::json &j_) : j(j_), in_line(mid_line()[j_["ty"].get<std::string>()]) {
+        line_time = j["at"];
+        has_groups = j["da"].count("ln") && j["da"]["ln"].is_array();
+    }
+
+    // Renders txt[pos, end), which must follow on from the previous call
+    std::string stamp(const std::string &txt, size_t pos, size_t end) {
+        if (!opt_timestamps) return txt.substr(pos, end - pos);
+
+        std::string output;
+
+        while (pos < end) {
+            if (has_groups && !lines_left_in_group && group < j["da"]["ln"].size()) {
+                auto &g = j["da"]["ln"][group++];
+                lines_left_in_group = g[0];
+                line_time += g[1].get<uint64_t>();
+            }
+
+            size_t line_end = txt.find('\n', pos);
+            bool complete = line_end < end;
+            if (!complete) line_end = end - 1;
+
+            if (!in_line) output += std::string("[") + render_line_time(line_time) + "] ";
+            output.append(txt, pos, line_end - pos + 1);
+
+            in_line = !complete;
+            if (complete && lines_left_in_group) lines_left_in_group--;
+            pos = line_end + 1;
+        }
+
+        return output;
+    }
+
+    // Renders a complete line that isn't part of the entry's text
+    std::string insert(const std::string &line, uint64_t time) {
+        if (!opt_timestamps) return line;
+        return std::string("[") + render_line_time(time) + "] " + line;
+    }
+
+  private:
+    static std::unordered_map<std::string, bool> &mid_line() {
+        static std::unordered_map<std::string, bool> m; // per entry type
+        return m;
+    }
+
+    nlohmann::json &j;
+    bool &in_line;
+    uint64_t line_time;
+    uint64_t lines_left_in_group = 0;
+    size_t group = 0;
+    bool has_groups;
+};
+
+
+// Entries captured with run.collapse have "rp": [[offset, count, first, last], ...]
+// for runs of lines dropped because they repeated the line before offset. The
+// repeated line may have been the last one of an earlier entry.
+
+static void remember_last_line(std::string &last_line, const std::string &txt, size_t pos, size_t end) {
+    if (end <= pos || txt[end - 1] != '\n') return;
+
+    size_t start = end - 1 > pos ? txt.rfind('\n', end - 2) : std::string::npos;
+    start = (start == std::string::npos || start < pos) ? pos : start + 1;
+
+    last_line.assign(txt, start, end - start);
+}
+
+static std::string render_text(nlohmann::json &j, const std::string &txt) {
+    static std::unordered_map<std::string, std::string> last_lines; // per entry type
+
+    line_stamper stamper(j);
+    std::string &last_line = last_lines[j["ty"].get<std::string>()];
+    std::string output;
+    size_t pos = 0;
+
+    if (j["da"].count("rp") && j["da"]["rp"].is_array()) {
+        uint64_t at = j["at"];
+
+        for (auto &r : j["da"]["rp"]) {
+            size_t offset = std::min(r[0].get<size_t>(), txt.size());
+            uint64_t count = r[1];
+
+            if (offset < pos) continue;
+
+            output += stamper.stamp(txt, pos, offset);
+            if (opt_expand_repeats) remember_last_line(last_line, txt, pos, offset);
+            pos = offset;
+
+            if (opt_expand_repeats) {
+                for (uint64_t i = 0; i < count; i++) {
+                    output += stamper.insert(last_line, at + (i + 1 == count ? r[3] : r[2]).get<uint64_t>());
+                }
+            } else {
+                output += stamper.insert(logp::concat_string("[... previous line repeated ", count, " more time", (count == 1 ? "" : "s"), " ...]\n"), at + r[3].get<uint64_t>());
+            }
+        }
+    }
+
+    output += stamper.stamp(txt, pos, txt.size());
+    if (opt_expand_repeats) remember_last_line(last_line, txt, pos, txt.size());
+
+    return output;
+}
+
+
+// Entries uploaded with run.compress share one deflate stream per entry type
+
+struct compressed_stream_state {
+    logp::inflate_stream inflater;
+    uint64_t next_seq = 0;
+    bool broken = false;
+};
+
+static std::string decompress_entry(nlohmann::json &j) {
+    static std::unordered_map<std::string, compressed_stream_state> streams;
+
+    auto &state = streams[j["ty"].get<std::string>()];
+    if (state.broken) return "";
+
+    uint64_t seq = j["da"].count("zs") ? j["da"]["zs"].get<uint64_t>() : 0;
+
+    if (seq != state.next_seq) {
+        PRINT_WARNING << "missing compressed " << j["ty"] << " chunk " << state.next_seq << ", unable to decompress the rest of this stream";
+        state.broken = true;
+        return "";
+    }
+
+    state.next_seq++;
+
+    return state.inflater.decompress(logp::util::base64_decode(j["da"]["z"].get<std::string>()));
+}
+
+
 void do_output(nlohmann::json &j) {
-    std::string txt = j["da"]["txt"];
-    txt = util::utf8_decode_binary(txt);
+    std::string txt;
+
+    if (j["da"].count("txt")) {
+        txt = j["da"]["txt"].get<std::string>();
+        txt = util::utf8_decode_binary(txt);
+    } else if (j["da"].count("z")) {
+        txt = decompress_entry(j);
+    } else if (j["da"].count("json")) {
+        txt = j["da"]["json"].dump() + "\n";
+    } else if (j["da"].count("elided")) {
+        txt = logp::concat_string("\n[... ", j["da"]["elided"].get<uint64_t>(), " bytes elided ...]\n");
+    }
 
-    if (j["ty"] == "stdout") {
-        std::cout << txt;
-    } else if (j["ty"] == "stderr") {
+    txt = render_text(j, txt);
+
+    if (j["ty"] == "stderr") {
         std::cerr << txt;
+    } else {
+        std::cout << txt;
     }
 }
 
@@ -101,6 +291,7 @@ void tail::execute() {
 
         query["where"]["or"].push_back(nlohmann::json::array({ "ty", "stdout" }));
         query["where"]["or"].push_back(nlohmann::json::array({ "ty", "stderr" }));
+        for (auto &t : opt_types) query["where"]["or"].push_back(nlohmann::json::array({ "ty", t }));
         query["where"]["or"].push_back(nlohmann::json::array({ "en" }));
 
         logp::websocket::request_get r;
@@ -133,7 +324,7 @@ void tail::execute() {
             [&](tail_msg_monitoring &){
                 monitoring = true;
 
-                std::sort(entries.begin(), entries.end(), [](const nlohmann::json &a, const nlohmann::json &b){
+                std::stable_sort(entries.begin(), entries.end(), [](const nlohmann::json &a, const nlohmann::json &b){
                     return a.at("at") < b.at("at");
                 });
 
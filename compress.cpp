@@ -0,0 +1,91 @@
+#include <string.h>
+
+#include <string>
+
+#include "logp/util.h"
+#include "logp/compress.h"
+
+
+namespace logp {
+
+
+deflate_stream::deflate_stream(int level) {
+    memset(&zs, 0, sizeof(zs));
+
+    if (deflateInit(&zs, level) != Z_OK) throw logp::error("unable to initialize deflate stream: ", zs.msg ? zs.msg : "?");
+}
+
+deflate_stream::~deflate_stream() {
+    deflateEnd(&zs);
+}
+
+std::string deflate_stream::compress(const std::string &input) {
+    std::string output;
+    output.resize(deflateBound(&zs, input.size()) + 16);
+
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    zs.avail_in = input.size();
+
+    size_t produced = 0;
+
+    while (1) {
+        zs.next_out = reinterpret_cast<Bytef*>(&output[produced]);
+        zs.avail_out = output.size() - produced;
+
+        int ret = deflate(&zs, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR) throw logp::error("deflate error: ", zs.msg ? zs.msg : "?");
+
+        produced = output.size() - zs.avail_out;
+
+        if (zs.avail_out != 0) break;
+
+        output.resize(output.size() * 2);
+    }
+
+    output.resize(produced);
+
+    return output;
+}
+
+
+inflate_stream::inflate_stream() {
+    memset(&zs, 0, sizeof(zs));
+
+    if (inflateInit(&zs) != Z_OK) throw logp::error("unable to initialize inflate stream: ", zs.msg ? zs.msg : "?");
+}
+
+inflate_stream::~inflate_stream() {
+    inflateEnd(&zs);
+}
+
+std::string inflate_stream::decompress(const std::string &input) {
+    std::string output;
+    output.resize(input.size() * 4 + 4096);
+
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    zs.avail_in = input.size();
+
+    size_t produced = 0;
+
+    while (1) {
+        zs.next_out = reinterpret_cast<Bytef*>(&output[produced]);
+        zs.avail_out = output.size() - produced;
+
+        int ret = inflate(&zs, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) throw logp::error("inflate error: ", zs.msg ? zs.msg : "?");
+
+        produced = output.size() - zs.avail_out;
+
+        if (zs.avail_in == 0 && zs.avail_out != 0) break;
+        if (ret == Z_STREAM_END) break;
+
+        output.resize(output.size() * 2);
+    }
+
+    output.resize(produced);
+
+    return output;
+}
+
+
+}
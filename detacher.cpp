@@ -0,0 +1,80 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "logp/util.h"
+#include "logp/detacher.h"
+
+
+namespace logp {
+
+
+static pid_t uploader_pid = -1;
+
+
+void detacher::start() {
+    if (pipe(status_pipe)) throw logp::error("unable to create pipe: ", strerror(errno));
+
+    fcntl(status_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(status_pipe[1], F_SETFD, FD_CLOEXEC);
+
+    pid_t fork_ret = fork();
+
+    if (fork_ret == -1) throw logp::error("unable to fork: ", strerror(errno));
+
+    if (fork_ret == 0) {
+        close(status_pipe[0]);
+        status_pipe[0] = -1;
+        return;
+    }
+
+    close(status_pipe[1]);
+    uploader_pid = fork_ret;
+
+    // Signals meant for logp, such as a supervisor's SIGTERM, are passed on
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = [](int signum){ kill(uploader_pid, signum); };
+    sigemptyset(&sa.sa_mask);
+
+    for (int signum : { SIGHUP, SIGINT, SIGQUIT, SIGTERM }) sigaction(signum, &sa, nullptr);
+
+    int wait_status;
+    ssize_t ret;
+
+    while ((ret = read(status_pipe[0], &wait_status, sizeof(wait_status))) == -1 && errno == EINTR) {}
+
+    if (ret == sizeof(wait_status)) _exit(WEXITSTATUS(wait_status));
+
+    // The uploader exited without detaching, usually because of an error it has reported
+    int uploader_status = 0;
+    while (waitpid(fork_ret, &uploader_status, 0) == -1 && errno == EINTR) {}
+
+    _exit(WIFEXITED(uploader_status) ? WEXITSTATUS(uploader_status) : 1);
+}
+
+
+void detacher::detach(int wait_status) {
+    if (status_pipe[1] == -1) return;
+
+    // A caller reading our output, as in $(logp run ...), would otherwise wait for the upload
+    int devnull = open("/dev/null", O_RDWR);
+
+    if (devnull != -1) {
+        dup2(devnull, 0);
+        dup2(devnull, 1);
+        dup2(devnull, 2);
+        if (devnull > 2) close(devnull);
+    }
+
+    if (write(status_pipe[1], &wait_status, sizeof(wait_status)) != sizeof(wait_status)) PRINT_WARNING << "unable to pass job status to waiting process: " << strerror(errno);
+
+    close(status_pipe[1]);
+    status_pipe[1] = -1;
+}
+
+}
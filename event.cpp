@@ -8,6 +8,13 @@
 
 namespace logp {
 
+event::~event() {
+    std::unique_lock<std::mutex> lock(internal_mutex);
+
+    if (heartbeat_timer_cancel_token) timer.cancel(heartbeat_timer_cancel_token);
+}
+
+
 void event::start(nlohmann::json &body) {
     {
         std::unique_lock<std::mutex> lock(internal_mutex);
@@ -39,7 +46,8 @@ void event::end(nlohmann::json &body) {
             throw logp::error("last message in an event must have 'en' param");
         }
 
-        timer.cancel(heartbeat_timer_cancel_token);
+        if (heartbeat_timer_cancel_token) timer.cancel(heartbeat_timer_cancel_token);
+        heartbeat_timer_cancel_token = 0;
     }
 
     add(body);
@@ -121,7 +129,8 @@ void event::handle_start_ack(nlohmann::json &resp) {
     event_id = resp["ev"];
     PRINT_DEBUG << "assigned event_id: " << event_id;
 
-    if (heartbeat_interval) {
+    // Short jobs can end before their start is acknowledged
+    if (heartbeat_interval && !ended) {
         heartbeat_timer_cancel_token = timer.repeat(heartbeat_interval, [&]{
             logp::websocket::request_hrt r{event_id};
             ws_worker.push_move_new_request(r);
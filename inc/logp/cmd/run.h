@@ -1,5 +1,13 @@
 #pragma once
 
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "nlohmann/json.hpp"
+
 #include "logp/cmd/base.h"
 
 namespace logp { namespace cmd {
@@ -13,11 +21,28 @@ class run : public base {
     void execute();
 
   private:
+    void execute_parallel();
+    nlohmann::json job_start_data(const std::vector<std::string> &cmd, pid_t pid, pid_t ppid);
+
     std::string opt_tag;
+    std::vector<std::pair<int, std::string>> opt_capture_fds;
+    std::vector<std::pair<std::string, std::string>> opt_capture_fifos;
+    bool opt_pty = false;
+    std::string opt_follow;
+    bool opt_sample = false;
+    bool opt_perf = false;
+    bool opt_detach = false;
+    bool opt_timings = false;
+    std::string opt_manifest;
+    uint64_t opt_jobs = 0;
 
     bool config_stderr;
     bool config_stdout;
-    bool config_follow;
+    std::string config_follow; // "preload", "proc", "ptrace" or empty when not following
+    bool config_pty;
+    bool config_sample;
+    bool config_perf;
+    bool config_detach;
 };
 
 }}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <string>
+
+
+namespace logp {
+
+// A deflate stream that lives for the whole capture. Each chunk is sync-flushed so
+// it can be decoded as soon as it arrives, while later chunks still get to refer
+// back to earlier output.
+
+class deflate_stream {
+  public:
+    deflate_stream(int level);
+    ~deflate_stream();
+
+    std::string compress(const std::string &input);
+
+  private:
+    z_stream zs;
+};
+
+class inflate_stream {
+  public:
+    inflate_stream();
+    ~inflate_stream();
+
+    std::string decompress(const std::string &input);
+
+  private:
+    z_stream zs;
+};
+
+}
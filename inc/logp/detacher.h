@@ -0,0 +1,26 @@
+#pragma once
+
+#include <unistd.h>
+
+
+namespace logp {
+
+// Lets `logp run` return the job's status as soon as the job is done, leaving the
+// upload to finish in the background. fork() only keeps the calling thread, so
+// this has to happen before any threads are started: the original process stays
+// behind as a waiter for the caller while the new one does everything else, and
+// passes the waiter the job's status once its output has been written out.
+
+class detacher {
+  public:
+    // Doesn't return in the waiter, which exits with the job's status
+    void start();
+
+    // Sends the status to the waiter and lets go of stdin, stdout and stderr
+    void detach(int wait_status);
+
+  private:
+    int status_pipe[2] = { -1, -1 };
+};
+
+}
@@ -19,6 +19,7 @@ namespace logp {
 class event {
   public:
     event(hoytech::timer &timer_, logp::websocket::worker &ws_worker_) : timer(timer_), ws_worker(ws_worker_) {}
+    ~event();
 
     void start(nlohmann::json &body);
     void add(nlohmann::json &body);
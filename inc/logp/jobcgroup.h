@@ -0,0 +1,46 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <string>
+
+#include "nlohmann/json.hpp"
+
+
+namespace logp {
+
+// Runs the job in its own cgroup v2 sub-cgroup of logp's cgroup, where that is
+// delegated to us, so that its totals cover every process it started, including
+// daemons that double-forked away from wait4(). Reading them at the end costs a
+// few small files and nothing while the job runs.
+//
+// memory.peak and io.stat need the memory and io controllers. logp doesn't
+// enable those itself (that changes the whole delegated subtree and can fail
+// under the cgroup v2 "no internal processes" rule), so they are reported only
+// when whoever set up the delegation already did. cpu.stat and the pressure
+// (PSI) totals are always there.
+
+class job_cgroup {
+  public:
+    job_cgroup() {};
+    ~job_cgroup();
+
+    bool create(); // before fork(), false if cgroup v2 isn't usable
+    void child();  // in the child, joins the cgroup
+    bool parent(); // after fork(), false if the child couldn't join the cgroup
+
+    nlohmann::json stats();
+
+    // Processes still running are moved back to logp's cgroup
+    void remove();
+
+  private:
+    std::string parent_path;
+    std::string path;
+    int procs_fd = -1;
+    int joined_pipe[2] = { -1, -1 }; // child tells the parent whether it joined
+
+    void close_fds();
+};
+
+}
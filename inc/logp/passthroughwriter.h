@@ -0,0 +1,55 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <string>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+namespace logp {
+
+// Copies captured output back to the original descriptor (usually a terminal)
+// from its own thread, so a slow consumer doesn't stall the capture/upload path.
+
+class passthrough_writer {
+  public:
+    enum class policy {
+        block,  // capture thread waits for space when the buffer is full
+        drop,   // passthrough output that doesn't fit in the buffer is discarded
+        buffer, // oldest buffered output is discarded to make room, so the latest is shown
+    };
+
+    static policy parse_policy(std::string name);
+
+    passthrough_writer(int fd_, policy pol_, size_t max_buffered_);
+    ~passthrough_writer() {
+        finish();
+    }
+
+    void run();
+    void write(const char *data, size_t len);
+    void finish(); // waits a few seconds at most for buffered output to be written
+
+  private:
+    const int fd;
+    const policy pol;
+    const size_t max_buffered;
+    bool can_stall = true; // false for regular files, which never block for long
+
+    std::thread t;
+    std::mutex m;
+    std::condition_variable cv_data;
+    std::condition_variable cv_space;
+    std::deque<std::string> queue;
+    size_t buffered = 0;
+    bool finishing = false;
+    std::chrono::steady_clock::time_point finish_deadline;
+    bool failed = false;
+    uint64_t dropped = 0;
+};
+
+}
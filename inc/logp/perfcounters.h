@@ -0,0 +1,49 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+
+namespace logp {
+
+// Counts CPU events for the job and everything it starts with perf_event_open().
+// The counters are inherited by children and only enabled when the job execs, so
+// they have to be opened between fork() and exec(): the child waits for that.
+// A child's counts are only added to the totals when it exits.
+//
+// Which counters can be opened depends on kernel.perf_event_paranoid and on the
+// hardware (most VMs have no hardware counters). Kernel-mode counts are dropped
+// when they're not permitted, and counters that can't be opened are left out.
+
+class perf_counters {
+  public:
+    perf_counters() {};
+    ~perf_counters();
+
+    static bool supported();
+
+    void prepare();          // before fork()
+    void child();            // in the child, waits until the counters are open
+    void open(pid_t pid);    // in the parent, then lets the child continue
+
+    // Totals, scaled up if the kernel had to multiplex the counters. ipc is only
+    // given when cycles and instructions were counted over the same time
+    nlohmann::json read();
+
+  private:
+    struct counter {
+        const char *name;
+        int fd;
+    };
+
+    std::vector<counter> counters;
+    bool user_only = false;
+    bool ipc_grouped = false; // cycles and instructions share a group
+    int sync_pipe[2] = { -1, -1 };
+};
+
+}
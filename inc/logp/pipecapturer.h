@@ -3,119 +3,147 @@
 #include <unistd.h>
 
 #include <string>
+#include <vector>
 #include <functional>
 #include <thread>
 #include <mutex>
+#include <memory>
 
 #include "hoytech/timer.h"
 
 #include "logp/util.h"
+#include "logp/passthroughwriter.h"
 
 
 namespace logp {
 
+struct capture_options {
+    passthrough_writer::policy passthrough_policy = passthrough_writer::policy::block;
+    size_t passthrough_buffer = 1024*1024;
+
+    // Flush triggers. The delay used is scaled between min and max according to the
+    // observed byte rate: slow (interactive) output is flushed after flush_min_delay,
+    // fast (bulk) output waits up to flush_max_delay or until flush_bytes accumulate.
+    uint64_t flush_min_delay = 10*1000;
+    uint64_t flush_max_delay = 100*1000;
+    size_t flush_bytes = 256*1024;
+    bool flush_newline = false;
+
+    // Retention: when either is non-zero, only the first head_bytes and the last
+    // tail_bytes of the stream are kept. The rest is counted as elided.
+    size_t head_bytes = 0;
+    size_t tail_bytes = 0;
+
+    // Line framing: chunks are split on newlines and record when each line arrived
+    bool lines = false;
+
+    // Repeated-line collapsing: consecutive lines that are identical (exact) or that
+    // differ only in their digits (digits) are counted instead of being kept
+    enum class collapse_mode { none, exact, digits };
+    collapse_mode collapse = collapse_mode::none;
+
+    // Internal descriptors are kept at or above this so they can't collide with
+    // descriptors being set up in the child
+    int min_internal_fd = 3;
+};
+
+struct capture_line_group {
+    uint64_t count; // number of newline-terminated lines
+    uint64_t timestamp; // when they were read
+};
+
+struct capture_repeat {
+    size_t offset; // position in data where the repeats would have appeared
+    uint64_t count; // number of lines dropped, all repeats of the line before offset
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+};
+
+struct capture_chunk {
+    uint64_t timestamp = 0;
+    uint64_t elided = 0; // bytes omitted immediately before data
+    std::string data;
+    std::vector<capture_line_group> lines; // only with capture_options::lines
+    std::vector<capture_repeat> repeats; // only with capture_options::collapse
+    bool tail = false; // what capture_options::tail_bytes kept of the end of the stream
+};
+
 class pipe_capturer {
   public:
-    pipe_capturer(int fd_, hoytech::timer &timer_, std::function<void(std::string &, uint64_t)> data_cb_, std::function<void()> end_cb_)
-                : fd(fd_), timer(timer_), data_cb(data_cb_), end_cb(end_cb_) {
-        if (pipe(pipe_descs) != 0) {
-            PRINT_ERROR << "unable to create descriptor capture pipe: " << strerror(errno);
-            exit(1);
-        }
-    }
-
-    void child() {
-        dup2(pipe_descs[1], fd);
-        close(pipe_descs[0]);
-        close(pipe_descs[1]);
-        pipe_descs[0] = pipe_descs[1] = -1;
-    }
-
-    void parent() {
-        close(pipe_descs[1]);
-        pipe_descs[1] = -1;
-
-        t = std::thread([this]() {
-            while(1) {
-                std::string buf;
-                buf.resize(4096);
-
-                read_again:
-                ssize_t ret = ::read(pipe_descs[0], &buf[0], 4096);
-                if (ret <= 0) {
-                    if (ret == -1 && errno == EINTR) goto read_again;
-                    pipe_closed();
-                    return;
-                }
-
-                uint64_t timestamp = logp::util::curr_time();
-
-                buf.resize(ret);
-
-                write_again:
-                ssize_t writeret = ::write(fd, buf.data(), buf.size());
-                if (writeret <= 0) {
-                    if (ret == -1 && errno == EINTR) goto write_again;
-                    pipe_closed();
-                    return;
-                }
-
-                new_data(buf, timestamp);
-            }
-        });
-    }
+    // Captures what the child writes to fd, passing it through to passthrough_fd (-1 for none)
+    pipe_capturer(int fd_, int passthrough_fd, hoytech::timer &timer_, const capture_options &opts_, std::function<void(capture_chunk &)> data_cb_, std::function<void()> end_cb_);
+
+    // Captures what is written to the named FIFO, creating it if necessary
+    pipe_capturer(std::string fifo_path_, hoytech::timer &timer_, const capture_options &opts_, std::function<void(capture_chunk &)> data_cb_, std::function<void()> end_cb_);
+
+    // Captures from a descriptor the parent already has open, such as a pty master.
+    // The capturer takes ownership of read_fd.
+    static std::unique_ptr<pipe_capturer> adopt(int read_fd, int passthrough_fd, hoytech::timer &timer_, const capture_options &opts_, std::function<void(capture_chunk &)> data_cb_, std::function<void()> end_cb_);
+
+    ~pipe_capturer();
+
+    void child();
+    void parent();
+
+    // FIFOs are held open so readers don't see EOF before the job's writers open
+    // them. Call this once the job has exited to let the capture finish.
+    void release();
 
   private:
-    void new_data(std::string &buf, uint64_t timestamp) {
-        std::unique_lock<std::mutex> lock(pending_mutex);
-
-        if (pending_buffer.size()) {
-            pending_buffer.append(buf);
-        } else {
-            pending_buffer.swap(buf);
-            pending_timestamp = timestamp;
-        }
-
-        if (!pending_timer_cancel_token) {
-            pending_timer_cancel_token = timer.once(100*1000, [this](){
-                pending_timer_cancel_token = 0;
-                flush_pending();
-            });
-        }
-    }
-
-    void flush_pending() {
-        std::unique_lock<std::mutex> lock(pending_mutex);
-
-        if (pending_buffer.size()) {
-            data_cb(pending_buffer, pending_timestamp);
-            pending_buffer.clear();
-        }
-
-        if (pending_timer_cancel_token) {
-            timer.cancel(pending_timer_cancel_token);
-            pending_timer_cancel_token = 0;
-        }
-    }
-
-    void pipe_closed() {
-        close(pipe_descs[0]);
-        pipe_descs[0] = -1;
-        flush_pending();
-        end_cb();
-    }
+    pipe_capturer(hoytech::timer &timer_, const capture_options &opts_, std::function<void(capture_chunk &)> data_cb_, std::function<void()> end_cb_)
+                : fd(-1), timer(timer_), opts(opts_), data_cb(data_cb_), end_cb(end_cb_), head_remaining(opts_.head_bytes) {}
+
+    void new_data(const char *data, size_t len, uint64_t timestamp);
+    void collapse_lines(const char *data, size_t len, uint64_t timestamp);
+    void end_repeat_run();
+    void take_partial_line();
+    bool holds_partial_lines();
+    bool has_pending();
+    void retain_data(const char *data, size_t len, uint64_t timestamp);
+    void flush_retained();
+    void update_rate(size_t bytes, uint64_t timestamp);
+    uint64_t current_flush_delay();
+    void schedule_flush();
+    void flush_pending(bool force);
+    void pipe_closed();
 
     const int fd;
     hoytech::timer &timer;
-    int pipe_descs[2];
-    std::function<void(std::string &, uint64_t timestamp)> data_cb;
+    const capture_options opts;
+    int pipe_descs[2] = { -1, -1 };
+    std::string fifo_path;
+    bool fifo_created = false;
+    std::function<void(capture_chunk &)> data_cb;
     std::function<void()> end_cb;
     std::thread t;
+    std::string read_buffer;
+    std::unique_ptr<passthrough_writer> passthrough;
 
     std::mutex pending_mutex;
     std::string pending_buffer;
+    std::vector<capture_line_group> pending_lines;
     uint64_t pending_timestamp;
+    uint64_t partial_since = 0; // arrival of a trailing partial line held back from flushes, or 0
+    uint64_t last_timestamp = 0;
     hoytech::timer::cancel_token pending_timer_cancel_token = 0;
+
+    std::string partial_line; // collapse mode holds incomplete lines here
+    std::string prev_line; // digit-normalized in digits mode
+    std::string normalized_line; // scratch for digits mode
+    bool have_prev = false;
+    uint64_t repeat_count = 0;
+    uint64_t repeat_first_timestamp = 0;
+    uint64_t repeat_last_timestamp = 0;
+    std::vector<capture_repeat> pending_repeats;
+
+    double byte_rate = 0; // bytes per second, exponentially weighted over time
+    uint64_t rate_window_start = 0;
+    size_t rate_window_bytes = 0;
+
+    size_t head_remaining = 0;
+    std::string tail_ring;
+    size_t tail_ring_pos = 0;
+    uint64_t tail_total = 0; // bytes seen after the head
 };
 
 }
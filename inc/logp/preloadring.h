@@ -0,0 +1,154 @@
+#pragma once
+
+/*
+ * Shared memory ring used by logp_preload.so to report processes to the
+ * preload_watcher without a socket connection per process. This header is
+ * included by both the C shim and the C++ watcher.
+ *
+ * The ring is a byte ring of variable-sized records. Writers reserve space by
+ * advancing head with a CAS, fill in the record, and then publish it by storing
+ * its size last. The single reader consumes records in order from tail, zeroes
+ * them and advances tail. A record that would straddle the end of the ring is
+ * preceded by a padding record covering the rest of the ring.
+ *
+ * When the reader has nothing to do it sets reader_waiting and sleeps on it as a
+ * futex, so writers only make a syscall when the reader is actually asleep.
+ *
+ * A writer killed between reserving and publishing leaves a record whose size is
+ * never set. The reader gives up on it after a timeout and skips everything that
+ * was reserved when it first saw the stall.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#define LOGP_RING_SUPPORTED 1
+#endif
+
+
+#define LOGP_RING_MAGIC 0x676e697270676f6cULL /* "logpring" */
+#define LOGP_RING_VERSION 2
+#define LOGP_RING_DATA_SIZE (1024*1024)
+
+#define LOGP_RING_PADDING 0
+#define LOGP_RING_PROC_START 1
+#define LOGP_RING_PROC_EXIT 2
+
+/* Larger command lines go over the socket instead */
+#define LOGP_RING_MAX_RECORD (64*1024)
+
+
+struct logp_ring_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t data_size;
+    uint64_t head; /* bytes reserved by writers */
+    char pad1[40]; /* keep writers and the reader on separate cache lines */
+    uint64_t tail; /* bytes consumed by the reader */
+    uint32_t reader_waiting;
+    char pad2[52];
+};
+
+struct logp_ring_record {
+    uint32_t size; /* whole record including this header, multiple of 8. 0 until published */
+    uint16_t type;
+    uint16_t payload_len;
+    int32_t pid;
+    int32_t ppid;
+    uint64_t timestamp; /* CLOCK_MONOTONIC microseconds, also field 8 of socket messages */
+    uint64_t starttime; /* from /proc/self/stat for LOGP_RING_PROC_START, also field 9 */
+    /* followed by type-specific payload: NUL-separated argv for LOGP_RING_PROC_START,
+       optionally a logp_proc_exit for LOGP_RING_PROC_EXIT */
+};
+
+/* From getrusage() at exit. Times in microseconds, maxrss in kilobytes.
+   Also sent as fields 5 (self) and 6 (children) of socket exit messages. */
+struct logp_proc_usage {
+    uint64_t utime;
+    uint64_t stime;
+    uint64_t maxrss;
+    uint64_t minflt;
+    uint64_t majflt;
+    uint64_t inblock;
+    uint64_t oublock;
+    uint64_t nvcsw;
+    uint64_t nivcsw;
+};
+
+struct logp_proc_exit {
+    struct logp_proc_usage self;
+    struct logp_proc_usage children;
+    int32_t status; /* argument to exit(), also field 7 of socket exit messages */
+    int32_t has_status; /* status is only known where on_exit() is available */
+};
+
+
+#define LOGP_RING_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+static inline size_t logp_ring_mapping_size(void) {
+    return sizeof(struct logp_ring_header) + LOGP_RING_DATA_SIZE;
+}
+
+static inline char *logp_ring_data(struct logp_ring_header *hdr) {
+    return (char *)hdr + sizeof(struct logp_ring_header);
+}
+
+
+#ifdef LOGP_RING_SUPPORTED
+
+static inline void logp_ring_wake_reader(struct logp_ring_header *hdr) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&hdr->reader_waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&hdr->reader_waiting, 0, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &hdr->reader_waiting, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+/* Returns 0 on success, -1 if the ring is full or the record is too large */
+static inline int logp_ring_write(struct logp_ring_header *hdr, uint16_t type, int32_t pid, int32_t ppid, uint64_t timestamp, uint64_t starttime, const char *payload, size_t payload_len) {
+    uint64_t cap = hdr->data_size;
+    uint64_t len = LOGP_RING_ALIGN(sizeof(struct logp_ring_record) + payload_len);
+    uint64_t head, off, pad;
+    char *data = logp_ring_data(hdr);
+
+    if (len > LOGP_RING_MAX_RECORD || len > cap / 2) return -1;
+
+    while (1) {
+        head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+        uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+
+        off = head % cap;
+        pad = cap - off < len ? cap - off : 0;
+
+        if (head + pad + len - tail > cap) return -1;
+
+        if (__atomic_compare_exchange_n(&hdr->head, &head, head + pad + len, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+    }
+
+    if (pad) {
+        struct logp_ring_record *p = (struct logp_ring_record *)(data + off);
+        p->type = LOGP_RING_PADDING;
+        __atomic_store_n(&p->size, (uint32_t)pad, __ATOMIC_RELEASE);
+        off = 0;
+    }
+
+    struct logp_ring_record *r = (struct logp_ring_record *)(data + off);
+    r->type = type;
+    r->payload_len = (uint16_t)payload_len;
+    r->pid = pid;
+    r->ppid = ppid;
+    r->timestamp = timestamp;
+    r->starttime = starttime;
+    if (payload_len) memcpy((char *)r + sizeof(struct logp_ring_record), payload, payload_len);
+    __atomic_store_n(&r->size, (uint32_t)len, __ATOMIC_RELEASE);
+
+    logp_ring_wake_reader(hdr);
+
+    return 0;
+}
+
+#endif
@@ -4,7 +4,9 @@
 
 #include <functional>
 #include <thread>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 #include <string>
 #include <memory>
 
@@ -12,6 +14,7 @@
 #include "ev++.h"
 
 #include "logp/util.h"
+#include "logp/preloadring.h"
 
 
 namespace logp {
@@ -19,6 +22,10 @@ namespace logp {
 
 class preload_watcher;
 
+// Values of field 4 in messages from logp_preload.so. Messages without it are starts.
+static const uint16_t preload_message_start = 1;
+static const uint16_t preload_message_exit = 2;
+
 class preload_connection {
   public:
     preload_connection(preload_watcher *parent_, ev::dynamic_loop &loop, int fd_) : parent(parent_), io(loop), fd(fd_) {
@@ -33,13 +40,48 @@ class preload_connection {
 
   private:
     void readable();
+    void handle_message(const char *p, size_t len, uint64_t now);
+    void closed(uint64_t now);
 
     preload_watcher *parent;
     ev::io io;
     int fd;
     std::string buffer;
+    size_t consumed = 0; // decoded bytes at the front of buffer
     int pid = -1;
-    uint64_t start_ts = 0;
+    uint64_t proc_serial = 0; // which start of pid this connection reported
+};
+
+// Watches a pidfd, which becomes readable when the process exits. The shim's own
+// exit report is written before that but may not have been read yet, so the end
+// is held back briefly for it. pidfd is -1 for a process that had already exited.
+class pidfd_watch {
+  public:
+    pidfd_watch(preload_watcher *parent_, ev::dynamic_loop &loop, int pid_, uint64_t serial_, int pidfd_) : parent(parent_), io(loop), grace(loop), pid(pid_), serial(serial_), pidfd(pidfd_) {
+        io.set<pidfd_watch, &pidfd_watch::readable>(this);
+        grace.set<pidfd_watch, &pidfd_watch::grace_expired>(this);
+
+        if (pidfd == -1) readable();
+        else io.start(pidfd, ev::READ);
+    }
+
+    ~pidfd_watch() {
+        io.stop();
+        grace.stop();
+        if (pidfd != -1) close(pidfd);
+    }
+
+  private:
+    void readable();
+    void grace_expired();
+
+    preload_watcher *parent;
+    ev::io io;
+    ev::timer grace;
+    int pid;
+    uint64_t serial;
+    int pidfd;
+    uint64_t exited_at = 0;
 };
 
 class preload_watcher {
@@ -49,13 +91,46 @@ class preload_watcher {
     std::string get_socket_path() {
         return socket_path;
     }
+    // Empty unless the shared memory ring is in use
+    std::string get_ring_path() {
+        return ring_path;
+    }
+    // When exits are tracked with pidfds the shim needn't hold its socket open
+    bool get_pidfd_supported() {
+        return pidfd_supported;
+    }
+
+    // Processes report over a shared memory ring where supported. They fall back
+    // to the socket if the ring is full or unavailable.
+    bool use_ring = true;
+
     std::function<void(uint64_t ts, nlohmann::json &data)> on_proc_start;
     std::function<void(uint64_t ts, nlohmann::json &data)> on_proc_end;
 
   private:
     friend class preload_connection;
+    friend class pidfd_watch;
+
+    struct tracked_proc {
+        uint64_t serial;
+        std::unique_ptr<pidfd_watch> exit_watch; // null when the pid has to be polled
+    };
+
+    struct ring_event {
+        uint16_t type;
+        uint64_t ts;
+        uint64_t starttime;
+        nlohmann::json data;
+    };
 
     void handle_accept(ev::io &watcher, int revents);
+    uint64_t proc_started(uint64_t ts, nlohmann::json &data, uint64_t starttime = 0);
+    void proc_exited(uint64_t ts, int pid, uint64_t serial = 0, nlohmann::json data = nlohmann::json::object());
+    void poll_procs();
+    void setup_ring();
+    void read_ring();
+    void handle_ring_record(const struct logp_ring_record &r, const char *payload);
+    void drain_ring_events();
 
     std::string temp_dir;
     std::string socket_path;
@@ -63,6 +138,19 @@ class preload_watcher {
     std::thread t;
     std::unique_ptr<ev::dynamic_loop> loop;
     std::unordered_map<int, preload_connection> conn_map;
+
+    // Only touched from the loop thread
+    std::unordered_map<int, tracked_proc> procs;
+    uint64_t next_proc_serial = 1;
+    bool pidfd_supported = false;
+    std::unique_ptr<ev::timer> poll_timer;
+
+    std::string ring_path;
+    struct logp_ring_header *ring = nullptr;
+    std::thread ring_thread;
+    std::unique_ptr<ev::async> ring_async;
+    std::mutex ring_events_mutex;
+    std::vector<ring_event> ring_events; // decoded by ring_thread, handled in the loop thread
 };
 
 }
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+
+#include "nlohmann/json.hpp"
+
+
+namespace logp {
+
+// Folds short-lived followed processes into periodic roll-ups, so fork-heavy jobs
+// don't upload a start and end entry for every compiler or shell. A process is
+// reported individually once it has run for min_runtime, or if it exits with a
+// non-zero status. The rest are counted per executable and parent.
+
+class proc_aggregator {
+  public:
+    proc_aggregator(uint64_t min_runtime_, uint64_t interval_) : min_runtime(min_runtime_), interval(interval_) {}
+
+    void started(uint64_t ts, nlohmann::json &data);
+    void exited(uint64_t ts, nlohmann::json &data);
+
+    // Call periodically: reports processes that have become long-lived, and the
+    // roll-ups once interval has passed
+    void tick(uint64_t now);
+
+    // At the end of the job
+    void flush(uint64_t now);
+
+    std::function<void(uint64_t ts, nlohmann::json &data)> on_start;
+    std::function<void(uint64_t ts, nlohmann::json &data)> on_end;
+    std::function<void(uint64_t ts, nlohmann::json &data)> on_rollup;
+
+  private:
+    struct pending_proc {
+        uint64_t start;
+        nlohmann::json data;
+        std::string group_key;
+    };
+
+    struct proc_group {
+        nlohmann::json data; // exe, parent and a sample argv
+        uint64_t first_start = 0;
+        uint64_t last_end = 0;
+        uint64_t pending = 0; // members started but not yet exited or reported
+        uint64_t count = 0;
+        uint64_t runtime_total = 0;
+        uint64_t runtime_max = 0;
+        std::map<std::string, uint64_t> exits; // status ("?" if unknown) -> count
+    };
+
+    void report_individually(std::unordered_map<int, pending_proc>::iterator it);
+    void emit_rollups(uint64_t now);
+
+    uint64_t min_runtime;
+    uint64_t interval;
+    uint64_t window_start = 0;
+
+    std::unordered_map<int, pending_proc> pending;
+    std::unordered_map<int, std::string> live_exe; // pid -> argv[0] of every followed process still running
+    std::unordered_set<int> individual; // running processes that have been reported
+    std::map<std::string, proc_group> groups;
+};
+
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+
+namespace logp {
+
+// Periodically samples CPU, RSS and I/O of the job and the followed processes
+// added to it, from /proc/<pid>/stat and /proc/<pid>/io. Each sample is the total
+// over the processes, and batches of samples are handed to on_samples as one
+// "samples" proc entry:
+//
+//   { "what": "samples", "t": [...], "procs": [...], "rss": [...], "cpu": [...], "rd": [...], "wr": [...] }
+//
+// t (milliseconds after the entry's timestamp), procs and rss (kilobytes) are
+// delta-encoded: each value is the difference from the previous one. cpu
+// (microseconds), rd and wr (bytes read and written to storage) are the amounts
+// used since the previous sample. Counters of processes that exit between two
+// samples are lost.
+//
+// Reading /proc costs time per process, so the interval is stretched to keep the
+// sampler below about 1% of a core however many processes there are.
+
+class proc_sampler {
+  public:
+    proc_sampler() {};
+    ~proc_sampler() {
+        stop();
+    }
+
+    static bool supported();
+
+    void run(pid_t root_pid);
+    void stop();
+
+    // From any thread
+    void add(pid_t pid);
+
+    // Samples not yet handed to on_samples, once stopped
+    nlohmann::json take(uint64_t &ts);
+
+    uint64_t interval = 1000000; // microseconds
+    uint64_t max_interval = 60000000;
+    size_t batch = 60; // samples per entry
+
+    std::function<void(uint64_t ts, nlohmann::json &data)> on_samples;
+
+    // For benchmarks
+    uint64_t samples = 0;
+
+    // Handed to on_samples, only to be read once stopped
+    uint64_t batches = 0;
+
+  private:
+    struct sampled_proc {
+        uint64_t starttime = 0; // 0 until first read, distinguishes reused pids
+        uint64_t cpu = 0; // clock ticks
+        uint64_t rd = 0;
+        uint64_t wr = 0;
+    };
+
+    struct totals {
+        uint64_t ts = 0;
+        uint64_t procs = 0;
+        uint64_t rss = 0;
+        uint64_t cpu = 0;
+        uint64_t rd = 0;
+        uint64_t wr = 0;
+    };
+
+    void sample(std::unique_lock<std::mutex> &lock);
+    bool read_proc(pid_t pid, sampled_proc &p, totals &t);
+    nlohmann::json encode();
+
+    pid_t root = -1;
+    std::unordered_map<pid_t, sampled_proc> procs;
+    std::vector<totals> pending;
+    std::string buf;
+
+    std::thread t;
+    std::mutex m; // procs, pending and stopping
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "nlohmann/json.hpp"
+
+
+namespace logp {
+
+// Rebuilds the tree of followed processes from the proc entries as they are
+// uploaded (linked by evpid and evppid), so that a profile of the whole job can be
+// sent when it ends: the critical path, wall and CPU time per subtree and the
+// slowest commands. Consumers then don't have to replay every proc entry.
+//
+// CPU is only known for processes whose watcher reports rusage. A subtree's CPU
+// also counts its root's rusage_children when that is larger, since it includes
+// descendants that weren't followed or were folded into roll-ups.
+
+class proc_tree {
+  public:
+    proc_tree(size_t top_n_, size_t max_depth_) : top_n(top_n_), max_depth(max_depth_) {}
+
+    void started(uint64_t ts, nlohmann::json &data);
+    void ended(uint64_t ts, nlohmann::json &data);
+    void rollup(uint64_t ts, nlohmann::json &data);
+
+    // Processes still running at job_end are counted up to then
+    nlohmann::json summary(uint64_t job_end);
+
+  private:
+    struct proc_node {
+        uint64_t start = 0;
+        uint64_t end = 0;
+        bool ended = false;
+        std::string cmd;
+        uint64_t cpu = 0;
+        uint64_t children_cpu = 0;
+        uint64_t count = 1; // processes in a roll-up
+        uint64_t runtime_total = 0; // roll-ups only
+        bool aggregate = false;
+        std::vector<uint64_t> children;
+    };
+
+    struct subtree_totals {
+        uint64_t procs = 0;
+        uint64_t wall = 0; // sum over the processes, not elapsed time
+        uint64_t cpu = 0;
+    };
+
+    uint64_t wall(const proc_node &n, uint64_t job_end);
+    subtree_totals total(uint64_t id, uint64_t job_end);
+    nlohmann::json subtree(uint64_t id, size_t depth, uint64_t job_end);
+    nlohmann::json subtrees(std::vector<uint64_t> ids, size_t depth, uint64_t job_end);
+    nlohmann::json describe(uint64_t id, uint64_t job_end);
+
+    size_t top_n;
+    size_t max_depth;
+
+    std::unordered_map<uint64_t, proc_node> nodes; // by evpid
+    std::vector<uint64_t> roots;
+    uint64_t next_rollup_id = UINT64_MAX; // roll-ups have no evpid, so count down from the top
+
+    std::unordered_map<uint64_t, subtree_totals> totals; // filled in by summary()
+};
+
+}
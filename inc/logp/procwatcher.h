@@ -0,0 +1,91 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+
+namespace logp {
+
+// Follows a job's descendants by polling /proc/<pid>/task/*/children, for processes
+// logp_preload.so can't see (static binaries, setuid helpers, cleared environments).
+// Only the processes already known are rescanned, and the interval shrinks to
+// min_interval while processes come and go and backs off to max_interval when idle.
+// Processes that start and exit between two scans are missed.
+
+class proc_watcher {
+  public:
+    proc_watcher() {};
+    ~proc_watcher() {
+        stop();
+    }
+
+    static bool supported();
+
+    void run(pid_t root_pid);
+    void stop();
+
+    uint64_t min_interval = 10000; // microseconds
+    uint64_t max_interval = 500000;
+
+    std::function<void(uint64_t ts, nlohmann::json &data)> on_proc_start;
+    std::function<void(uint64_t ts, nlohmann::json &data)> on_proc_end;
+
+    // For benchmarks
+    uint64_t scans = 0;
+
+  private:
+    struct proc_stat {
+        std::string comm;
+        char state = 0;
+        int ppid = 0;
+        uint64_t num_threads = 0;
+        uint64_t starttime = 0; // clock ticks since boot, distinguishes reused pids
+        uint64_t minflt = 0, majflt = 0, utime = 0, stime = 0;
+        int exit_code = 0; // wait status, only set for zombies on Linux 3.5+
+        bool has_exit_code = false;
+    };
+
+    struct tracked_proc {
+        uint64_t starttime;
+        uint64_t generation; // of the last scan that saw it
+        int ppid;
+        std::string comm;
+
+        // A child with the same comm as its parent has probably not exec'ed yet, so
+        // its start is held back until the next scan to get the right argv
+        bool reported = false;
+        uint64_t first_seen = 0;
+        nlohmann::json argv;
+    };
+
+    bool scan(uint64_t generation); // true if anything started or exited
+    void visit(pid_t pid, uint64_t generation, uint64_t now, bool &changed);
+    void report_start(pid_t pid, tracked_proc &p);
+    void proc_exited(pid_t pid, uint64_t now, proc_stat *st);
+
+    // These all read into buf
+    bool read_stat(pid_t pid, proc_stat &st);
+    nlohmann::json read_argv(pid_t pid);
+    void read_children(pid_t pid, uint64_t num_threads, std::vector<pid_t> &out);
+
+    pid_t root = -1;
+    std::string self_comm;
+    std::unordered_map<pid_t, tracked_proc> procs;
+    std::string buf;
+
+    std::thread t;
+    std::mutex m;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+}
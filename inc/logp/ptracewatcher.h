@@ -0,0 +1,70 @@
+#pragma once
+
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <functional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <string>
+
+#include "nlohmann/json.hpp"
+
+
+namespace logp {
+
+// Follows every process of a job with ptrace, including forks that never exec and
+// static binaries. Tracees only stop on fork, clone and exec events (and signals),
+// never on ordinary syscalls, and exits are picked up from wait4().
+//
+// The tracer thread reaps the job itself, since waiting for it from another thread
+// would also consume ptrace stops, so its exit is reported through on_root_exit.
+
+class ptrace_watcher {
+  public:
+    ptrace_watcher() {};
+    ~ptrace_watcher() {
+        if (t.joinable()) t.join();
+    }
+
+    static bool supported();
+
+    void prepare(); // before fork()
+    void child();   // in the child, waits until the tracer has attached
+    void run(pid_t root_pid);
+
+    std::function<void(uint64_t ts, nlohmann::json &data)> on_proc_start;
+    std::function<void(uint64_t ts, nlohmann::json &data)> on_proc_end;
+    std::function<void(uint64_t ts, int status, struct rusage &ru)> on_root_exit;
+
+    // For benchmarks
+    uint64_t stops = 0;
+
+  private:
+    struct traced_proc {
+        int ppid;
+        uint64_t fork_ts;
+        nlohmann::json argv; // the parent's until it execs
+        bool reported = false;
+    };
+
+    void trace();
+    void task_created(pid_t parent_tid, pid_t tid, uint64_t now);
+    void record_task(pid_t parent_tid, pid_t tid, uint64_t now);
+    void execed(pid_t pid, uint64_t now);
+    void task_exited(pid_t tid, int status, uint64_t now);
+    void report_start(pid_t pid, uint64_t ts, bool forked);
+
+    pid_t root = -1;
+    int sync_pipe[2] = { -1, -1 };
+
+    std::unordered_map<pid_t, pid_t> task_tgid; // every traced task -> its process
+    std::unordered_map<pid_t, traced_proc> procs;
+    std::unordered_set<pid_t> awaiting_stop; // created, first stop not seen yet
+    std::unordered_set<pid_t> stopped_early; // first stop seen before the event that created it
+
+    std::thread t;
+};
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <termios.h>
+
+#include <string>
+#include <thread>
+
+
+namespace logp {
+
+// Runs the child on a pseudo-terminal so programs that check isatty() behave as they
+// would without logp. Our stdin is forwarded to the pty and window size changes are
+// copied across by resize().
+
+class pty {
+  public:
+    pty();
+    ~pty();
+
+    void child();
+    void parent();
+    void resize();
+
+    int get_master_fd() {
+        return master_fd;
+    }
+
+  private:
+    void forward_stdin();
+
+    int master_fd = -1;
+    std::string slave_path;
+    bool stdin_is_tty = false;
+    bool have_termios = false;
+    struct termios slave_termios;
+    std::thread stdin_thread;
+};
+
+}
@@ -53,12 +53,27 @@ uint64_t curr_time();
 
 uint64_t timeval_to_usecs(struct timeval &);
 
+bool read_file(const char *path, std::string &out); // whole file, for /proc where stat() sizes are 0
+
+// Map other clocks to curr_time() wall clock microseconds
+uint64_t monotonic_time(); // CLOCK_MONOTONIC microseconds, as sent by logp_preload.so
+uint64_t monotonic_to_wall(uint64_t monotonic_usecs);
+uint64_t proc_starttime_to_wall(uint64_t ticks); // starttime field of /proc/<pid>/stat
+uint64_t proc_starttime_resolution(); // microseconds per tick
+
+extern uint64_t process_start_time; // monotonic_time() when main() started
+
+size_t count_newlines(const char *data, size_t len);
+
 
 
 
 std::string utf8_encode_binary(std::string &input);
 std::string utf8_decode_binary(std::string &input);
 
+std::string base64_encode(const std::string &input);
+std::string base64_decode(const std::string &input);
+
 
 extern bool use_ansi_colours;
 
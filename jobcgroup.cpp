@@ -0,0 +1,246 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "logp/util.h"
+#include "logp/jobcgroup.h"
+
+
+namespace logp {
+
+
+static std::string cgroup2_mount() {
+    std::ifstream mounts("/proc/self/mounts");
+    std::string line;
+
+    while (std::getline(mounts, line)) {
+        std::istringstream fields(line);
+        std::string dev, dir, type;
+        fields >> dev >> dir >> type;
+
+        if (type == "cgroup2") return dir;
+    }
+
+    return "";
+}
+
+
+static std::string own_cgroup() {
+    std::ifstream cgroup("/proc/self/cgroup");
+    std::string line;
+
+    while (std::getline(cgroup, line)) {
+        if (line.compare(0, 3, "0::") == 0) return line.substr(3);
+    }
+
+    return "";
+}
+
+
+static bool write_file(const std::string &path, const std::string &contents) {
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    bool ok = write(fd, contents.data(), contents.size()) == static_cast<ssize_t>(contents.size());
+    close(fd);
+
+    return ok;
+}
+
+
+bool job_cgroup::create() {
+    std::string mount = cgroup2_mount();
+    std::string own = own_cgroup();
+
+    if (mount.empty() || own.empty()) {
+        PRINT_DEBUG << "cgroup v2 not available, job won't get its own cgroup";
+        return false;
+    }
+
+    parent_path = mount + (own == "/" ? "" : own);
+    path = parent_path + "/logp-" + std::to_string(getpid());
+
+    if (mkdir(path.c_str(), 0755) != 0) {
+        PRINT_DEBUG << "unable to create cgroup " << path << " (not delegated?): " << strerror(errno);
+        path.clear();
+        return false;
+    }
+
+    procs_fd = open((path + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+
+    if (procs_fd == -1) {
+        PRINT_DEBUG << "unable to open " << path << "/cgroup.procs: " << strerror(errno);
+        remove();
+        return false;
+    }
+
+    if (pipe(joined_pipe) != 0) {
+        PRINT_DEBUG << "unable to create pipe: " << strerror(errno);
+        close_fds();
+        remove();
+        return false;
+    }
+
+    fcntl(joined_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(joined_pipe[1], F_SETFD, FD_CLOEXEC);
+
+    return true;
+}
+
+
+void job_cgroup::child() {
+    if (procs_fd == -1) return;
+
+    // "0" is the writing process
+    char joined = '1';
+    if (write(procs_fd, "0", 1) != 1) {
+        PRINT_WARNING << "unable to join job cgroup: " << strerror(errno);
+        joined = '0';
+    }
+
+    close(procs_fd);
+    close(joined_pipe[0]);
+    if (write(joined_pipe[1], &joined, 1) != 1) {} // the parent sees EOF as not joined
+    close(joined_pipe[1]);
+}
+
+
+bool job_cgroup::parent() {
+    if (procs_fd == -1) return false;
+
+    close(joined_pipe[1]);
+    joined_pipe[1] = -1;
+
+    // The child writes this before it can exec, or exits
+    char joined = 0;
+    while (::read(joined_pipe[0], &joined, 1) == -1 && errno == EINTR) {}
+
+    close_fds();
+
+    if (joined != '1') {
+        // Its totals would be those of an empty cgroup
+        remove();
+        return false;
+    }
+
+    return true;
+}
+
+
+void job_cgroup::close_fds() {
+    if (procs_fd != -1) close(procs_fd);
+    if (joined_pipe[0] != -1) close(joined_pipe[0]);
+    if (joined_pipe[1] != -1) close(joined_pipe[1]);
+    procs_fd = joined_pipe[0] = joined_pipe[1] = -1;
+}
+
+
+job_cgroup::~job_cgroup() {
+    close_fds();
+}
+
+
+// "key value" lines
+static nlohmann::json parse_flat_keyed(const std::string &contents) {
+    nlohmann::json out = nlohmann::json::object();
+
+    std::istringstream lines(contents);
+    std::string key;
+    uint64_t value;
+
+    while (lines >> key >> value) out[key] = value;
+
+    return out;
+}
+
+
+nlohmann::json job_cgroup::stats() {
+    nlohmann::json out = nlohmann::json::object();
+    if (path.empty()) return out;
+
+    std::string contents;
+
+    if (logp::util::read_file((path + "/cpu.stat").c_str(), contents)) out["cpu"] = parse_flat_keyed(contents);
+
+    if (logp::util::read_file((path + "/memory.peak").c_str(), contents)) out["memory_peak"] = strtoull(contents.c_str(), nullptr, 10);
+
+    if (logp::util::read_file((path + "/memory.events").c_str(), contents)) {
+        auto events = parse_flat_keyed(contents);
+        if (events.count("oom_kill") && events["oom_kill"].get<uint64_t>()) out["oom_kill"] = events["oom_kill"];
+    }
+
+    // One line per device: "8:0 rbytes=1 wbytes=2 rios=3 wios=4 dbytes=0 dios=0"
+    if (logp::util::read_file((path + "/io.stat").c_str(), contents)) {
+        nlohmann::json io = nlohmann::json::object();
+        std::istringstream words(contents);
+        std::string word;
+
+        while (words >> word) {
+            auto eq = word.find('=');
+            if (eq == std::string::npos) continue;
+
+            std::string key = word.substr(0, eq);
+            uint64_t value = strtoull(word.c_str() + eq + 1, nullptr, 10);
+            io[key] = (io.count(key) ? io[key].get<uint64_t>() : 0) + value;
+        }
+
+        out["io"] = io;
+    }
+
+    // "some avg10=0.00 avg60=0.00 avg300=0.00 total=1234", the total in microseconds
+    for (auto resource : { "cpu", "memory", "io" }) {
+        if (!logp::util::read_file((path + "/" + resource + ".pressure").c_str(), contents)) continue;
+
+        std::istringstream lines(contents);
+        std::string line;
+
+        while (std::getline(lines, line)) {
+            auto kind_end = line.find(' ');
+            auto total = line.find("total=");
+            if (kind_end == std::string::npos || total == std::string::npos) continue;
+
+            out["pressure"][resource][line.substr(0, kind_end)] = strtoull(line.c_str() + total + 6, nullptr, 10);
+        }
+    }
+
+    // Anything still running, such as daemons the job started
+    if (logp::util::read_file((path + "/cgroup.procs").c_str(), contents)) {
+        out["procs_remaining"] = std::count(contents.begin(), contents.end(), '\n');
+    }
+
+    return out;
+}
+
+
+void job_cgroup::remove() {
+    if (path.empty()) return;
+
+    if (rmdir(path.c_str()) != 0 && errno == EBUSY) {
+        // Processes left running go back to our cgroup, or nothing would remove it
+        std::string contents;
+
+        if (logp::util::read_file((path + "/cgroup.procs").c_str(), contents)) {
+            std::istringstream pids(contents);
+            std::string pid;
+
+            while (pids >> pid) write_file(parent_path + "/cgroup.procs", pid);
+        }
+
+        rmdir(path.c_str());
+    }
+
+    if (access(path.c_str(), F_OK) == 0) PRINT_WARNING << "unable to remove cgroup " << path << ": " << strerror(errno);
+
+    path.clear();
+}
+
+}
@@ -7,15 +7,24 @@
 #include <sys/un.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <fnmatch.h>
+#include <limits.h>
 
 #include <stdio.h>
 
+#include "logp/preloadring.h"
+
 
 
 static void append(void *data, size_t data_len, char **output, size_t *output_size, size_t *output_allocated) {
     if (*output_allocated - *output_size < data_len) {
         size_t new_size = (*output_allocated * 2) + data_len;
-        output = realloc(*output, new_size);
+        *output = realloc(*output, new_size);
         *output_allocated = new_size;
     }
 
@@ -80,17 +89,335 @@ static char *get_cmdline(size_t *len) {
 }
 
 
-static void init(void) __attribute__((constructor));
-static void init() {
-    char *logp_socket_path;
+/*
+ * Filters, set by logp run from the run.follow_* config. They are checked before
+ * anything is read or sent, so a process that is filtered out costs a few getenv()s.
+ *
+ *   LOGP_FOLLOW_INCLUDE    only report executables matching one of these globs
+ *   LOGP_FOLLOW_EXCLUDE    don't report executables matching any of these globs
+ *   LOGP_FOLLOW_MAX_DEPTH  don't report processes nested deeper below the job
+ *   LOGP_FOLLOW_SAMPLE     report this fraction (0 to 1) of processes, chosen by pid
+ *
+ * Glob lists are separated by colons. Globs containing a slash match the full
+ * path of the executable, others just its name.
+ *
+ * LOGP_FOLLOW_DEPTH is maintained by the shim itself as "<pid>:<depth>", so an
+ * exec() keeps its depth and children add one. logp run starts it at "0:-1".
+ * Depth only counts processes that load the shim, so forks that don't exec
+ * aren't counted.
+ */
+
+#ifdef __APPLE__
+#define PRELOAD_ENV_VAR "DYLD_INSERT_LIBRARIES"
+#else
+#define PRELOAD_ENV_VAR "LD_PRELOAD"
+#endif
+
+extern char **environ;
+
+// Replaces the value of a variable that is already set. bash has its own setenv(),
+// which does nothing this early, and it builds its environment from the original
+// envp array, so existing entries are swapped in place.
+static int replace_env(const char *name, const char *value) {
+    size_t name_len = strlen(name);
+
+    for (char **e = environ; e && *e; e++) {
+        if (strncmp(*e, name, name_len) != 0 || (*e)[name_len] != '=') continue;
+
+        size_t len = name_len + 1 + strlen(value) + 1;
+        char *entry = malloc(len);
+        if (!entry) return 0;
+
+        snprintf(entry, len, "%s=%s", name, value);
+        *e = entry; // owned by the environment from now on
+        return 1;
+    }
+
+    return 0;
+}
+
+static const char *exe_name(char *path_buf) {
+#ifdef __GLIBC__
+    extern char *program_invocation_name;
+    if (program_invocation_name && *program_invocation_name) return program_invocation_name;
+#endif
+
+    size_t len;
+    char *cmdline = get_cmdline(&len);
+    if (!cmdline) return "";
+
+    snprintf(path_buf, PATH_MAX, "%s", len ? cmdline : "");
+    free(cmdline);
+    return path_buf;
+}
+
+static const char *exe_path(char *path_buf) {
+#ifdef __linux__
+    ssize_t len = readlink("/proc/self/exe", path_buf, PATH_MAX - 1);
+    if (len > 0) {
+        path_buf[len] = '\0';
+        return path_buf;
+    }
+#endif
+
+    return exe_name(path_buf);
+}
+
+static int matches_glob_list(const char *list, const char *name) {
+    char pattern[PATH_MAX];
+    char path_buf[PATH_MAX];
+    const char *path = NULL;
+
+    while (*list) {
+        size_t len = strcspn(list, ":");
+
+        if (len && len < sizeof(pattern)) {
+            memcpy(pattern, list, len);
+            pattern[len] = '\0';
+
+            if (strchr(pattern, '/')) {
+                if (!path) path = exe_path(path_buf);
+                if (fnmatch(pattern, path, 0) == 0) return 1;
+            } else if (fnmatch(pattern, name, 0) == 0) {
+                return 1;
+            }
+        }
+
+        list += len;
+        if (*list) list++;
+    }
+
+    return 0;
+}
+
+static int get_depth(void) {
+    int depth = 0;
+
+    char *v = getenv("LOGP_FOLLOW_DEPTH");
+    if (v) {
+        char *end;
+        long pid = strtol(v, &end, 10);
+        if (*end == ':') {
+            depth = atoi(end + 1);
+            if (pid != getpid()) depth++;
+        }
+    }
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%d:%d", (int)getpid(), depth);
+    if (!replace_env("LOGP_FOLLOW_DEPTH", buf)) setenv("LOGP_FOLLOW_DEPTH", buf, 1);
+
+    return depth;
+}
+
+// So that children, which would all be too deep, don't load the shim at all
+static void remove_from_preload(void) {
+    char *v = getenv(PRELOAD_ENV_VAR);
+    if (!v) return;
+
+    char *out = malloc(strlen(v) + 1);
+    if (!out) return;
+
+    size_t out_len = 0;
+
+    while (*v) {
+        size_t len = strcspn(v, ": ");
+        const char *base = v + len;
+        while (base > v && base[-1] != '/') base--;
+
+        size_t base_len = v + len - base;
+        int is_shim = base_len == strlen("logp_preload.so") && memcmp(base, "logp_preload.so", base_len) == 0;
+
+        if (len && !is_shim) {
+            if (out_len) out[out_len++] = ':';
+            memcpy(out + out_len, v, len);
+            out_len += len;
+        }
+
+        v += len;
+        if (*v) v++;
+    }
+
+    out[out_len] = '\0';
+
+    replace_env(PRELOAD_ENV_VAR, out); // an empty value preloads nothing
+
+    free(out);
+}
+
+// Returns 1 if this process should be reported
+static int passes_filters(void) {
+    char *max_depth = getenv("LOGP_FOLLOW_MAX_DEPTH");
+    if (max_depth) {
+        int depth = get_depth();
+        if (depth >= atoi(max_depth)) remove_from_preload();
+        if (depth > atoi(max_depth)) return 0;
+    }
+
+    char *sample = getenv("LOGP_FOLLOW_SAMPLE");
+    if (sample) {
+        uint32_t h = (uint32_t)getpid() * 2654435761u; // spreads consecutive pids
+        if ((double)h / 4294967296.0 >= strtod(sample, NULL)) return 0;
+    }
+
+    char *include = getenv("LOGP_FOLLOW_INCLUDE");
+    char *exclude = getenv("LOGP_FOLLOW_EXCLUDE");
+
+    if (include || exclude) {
+        char name_buf[PATH_MAX];
+        const char *name = exe_name(name_buf);
+        const char *slash = strrchr(name, '/');
+        if (slash) name = slash + 1;
+
+        if (include && !matches_glob_list(include, name)) return 0;
+        if (exclude && matches_glob_list(exclude, name)) return 0;
+    }
+
+    return 1;
+}
+
+
+static void get_usage(int who, struct logp_proc_usage *u) {
+    struct rusage ru;
+
+    memset(u, 0, sizeof(*u));
+    if (getrusage(who, &ru) != 0) return;
+
+    u->utime = (uint64_t)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+    u->stime = (uint64_t)ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+#ifdef __APPLE__
+    u->maxrss = ru.ru_maxrss / 1024; // In bytes on OS X
+#else
+    u->maxrss = ru.ru_maxrss;
+#endif
+    u->minflt = ru.ru_minflt;
+    u->majflt = ru.ru_majflt;
+    u->inblock = ru.ru_inblock;
+    u->oublock = ru.ru_oublock;
+    u->nvcsw = ru.ru_nvcsw;
+    u->nivcsw = ru.ru_nivcsw;
+}
+
+
+/*
+ * Timestamps are taken here rather than when the watcher reads a message, which can
+ * lag on a loaded host. They are CLOCK_MONOTONIC so they survive wall clock steps,
+ * and the watcher maps them to wall time. The kernel's starttime (clock ticks since
+ * boot) is sent too, since a process may have been forked well before it exec()ed.
+ */
+
+static uint64_t monotonic_time() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) return 0;
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t get_starttime() {
+#ifdef __linux__
+    int fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+
+    char buf[1024];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) return 0;
+    buf[len] = '\0';
+
+    // Fields after the parenthesised command name, which may contain spaces
+    char *p = strrchr(buf, ')');
+    if (!p) return 0;
+
+    for (int field = 2; field < 22; field++) {
+        p = strchr(p + 1, ' ');
+        if (!p) return 0;
+    }
+
+    return strtoull(p + 1, NULL, 10);
+#else
+    return 0;
+#endif
+}
+
+
+static pid_t reported_pid; // forked children inherit our state but aren't tracked
+static uint64_t start_monotonic;
+static int socket_fd = -1;
+static int exit_status;
+static int has_exit_status;
+static int exit_handler_registered;
+
+static void report_exit(void);
+
+#ifdef __GLIBC__
+// exit() runs its handlers in reverse order of registration. The one that runs the
+// library destructors is registered by __libc_start_main after our constructor has
+// registered this, so this runs after fini() and sends the report itself.
+static void record_exit_status(int status, void *arg) {
+    (void)arg;
+    exit_status = status & 0xff; // as the parent would see it
+    has_exit_status = 1;
+    report_exit();
+}
+#endif
+
+
+#ifdef LOGP_RING_SUPPORTED
+
+static struct logp_ring_header *ring;
+
+static struct logp_ring_header *ring_attach() {
+    char *path = getenv("LOGP_RING_PATH");
+    if (!path) return NULL;
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < logp_ring_mapping_size()) {
+        close(fd);
+        return NULL;
+    }
+
+    void *p = mmap(NULL, logp_ring_mapping_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+
+    struct logp_ring_header *hdr = p;
+
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != LOGP_RING_MAGIC || hdr->version != LOGP_RING_VERSION || hdr->data_size != LOGP_RING_DATA_SIZE) {
+        munmap(p, logp_ring_mapping_size());
+        return NULL;
+    }
+
+    return hdr;
+}
+
+// Returns 1 if the start was recorded in the ring, otherwise the socket should be used
+static int ring_report_start() {
+    struct logp_ring_header *hdr = ring_attach();
+    if (!hdr) return 0;
+
+    size_t len = 0;
+    char *cmdline = get_cmdline(&len);
+
+    int ret = logp_ring_write(hdr, LOGP_RING_PROC_START, getpid(), getppid(), start_monotonic, get_starttime(), cmdline, cmdline ? len : 0);
+    free(cmdline);
+
+    if (ret != 0) {
+        munmap(hdr, logp_ring_mapping_size());
+        return 0;
+    }
+
+    ring = hdr;
+    return 1;
+}
+
+#endif
+
+
+static int connect_socket(const char *logp_socket_path) {
     int fd;
     struct sockaddr_un sa;
-    char *output;
-    size_t output_size;
-    size_t output_allocated;
-
-    logp_socket_path = getenv("LOGP_SOCKET_PATH");
-    if (!logp_socket_path) return;
 
     int sock_type = SOCK_STREAM;
 #ifdef SOCK_CLOEXEC
@@ -98,7 +425,7 @@ static void init() {
 #endif
 
     fd = socket(AF_UNIX, sock_type, 0);
-    if (fd == -1) return;
+    if (fd == -1) return -1;
 
 #ifndef SOCK_CLOEXEC
     fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
@@ -106,14 +433,58 @@ static void init() {
 
     sa.sun_family = AF_UNIX;
     size_t path_len = strlen(logp_socket_path);
-    if (path_len >= sizeof(sa.sun_path)) return;
+    if (path_len >= sizeof(sa.sun_path)) {
+        close(fd);
+        return -1;
+    }
     strcpy(sa.sun_path, logp_socket_path);
 
     if (connect(fd, (const struct sockaddr*)&sa, sizeof(sa)) == -1) {
         close(fd);
-        return;
+        return -1;
     }
 
+    return fd;
+}
+
+static int send_message(int fd, char *output, size_t output_size) {
+    memcpy(output, &output_size, sizeof(size_t));
+
+    ssize_t write_ret = write(fd, output, output_size);
+    free(output);
+
+    return write_ret <= 0 ? -1 : 0;
+}
+
+
+static void init(void) __attribute__((constructor));
+static void init() {
+    char *logp_socket_path;
+    int fd;
+    char *output;
+    size_t output_size;
+    size_t output_allocated;
+
+    start_monotonic = monotonic_time();
+
+    logp_socket_path = getenv("LOGP_SOCKET_PATH");
+    if (!logp_socket_path) return;
+
+    if (!passes_filters()) return;
+
+    reported_pid = getpid();
+
+#ifdef __GLIBC__
+    if (on_exit(record_exit_status, NULL) == 0) exit_handler_registered = 1;
+#endif
+
+#ifdef LOGP_RING_SUPPORTED
+    if (ring_report_start()) return;
+#endif
+
+    fd = connect_socket(logp_socket_path);
+    if (fd == -1) return;
+
     output_allocated = 4096;
     output_size = 0;
     output = malloc(output_allocated);
@@ -143,13 +514,82 @@ static void init() {
         }
     }
 
-    memcpy(output, &output_size, sizeof(size_t));
+    add_field(8, &start_monotonic, sizeof(start_monotonic), &output, &output_size, &output_allocated);
 
-    ssize_t write_ret = write(fd, output, output_size);
-    if (write_ret <= 0) {
+    {
+        uint64_t starttime = get_starttime();
+        if (starttime) add_field(9, &starttime, sizeof(starttime), &output, &output_size, &output_allocated);
+    }
+
+    if (send_message(fd, output, output_size) != 0) {
         close(fd);
         return;
     }
 
-    // keep fd open so we can detect when process exits
+    // The watcher tracks exits with a pidfd when it sets LOGP_PIDFD. Otherwise
+    // keep fd open so it can detect when the process exits.
+    if (getenv("LOGP_PIDFD")) close(fd);
+    else socket_fd = fd;
+}
+
+
+// Reports resource usage on a normal exit. Nothing is sent by processes that are
+// killed, call _exit() or exec(): the watcher still sees them end but without usage.
+
+static void fini(void) __attribute__((destructor));
+static void fini() {
+    if (!exit_handler_registered) report_exit();
+}
+
+static void report_exit() {
+    static int reported;
+
+    if (!reported_pid || getpid() != reported_pid || reported) return;
+    reported = 1;
+
+    uint64_t now = monotonic_time();
+
+    struct logp_proc_exit ex;
+    get_usage(RUSAGE_SELF, &ex.self);
+    get_usage(RUSAGE_CHILDREN, &ex.children);
+    ex.status = exit_status;
+    ex.has_status = has_exit_status;
+
+#ifdef LOGP_RING_SUPPORTED
+    if (ring && logp_ring_write(ring, LOGP_RING_PROC_EXIT, reported_pid, 0, now, 0, (const char *)&ex, sizeof(ex)) == 0) return;
+#endif
+
+    char *logp_socket_path = getenv("LOGP_SOCKET_PATH");
+    if (!logp_socket_path) return;
+
+    int fd = socket_fd != -1 ? socket_fd : connect_socket(logp_socket_path);
+    if (fd == -1) return;
+
+    size_t output_allocated = 256;
+    size_t output_size = sizeof(size_t); // leave room for total length
+    char *output = malloc(output_allocated);
+    if (!output) return;
+
+    {
+        uint16_t kind = 2;
+        add_field(4, &kind, sizeof(kind), &output, &output_size, &output_allocated);
+    }
+
+    {
+        pid_t pid = reported_pid;
+        add_field(1, &pid, sizeof(pid), &output, &output_size, &output_allocated);
+    }
+
+    add_field(5, &ex.self, sizeof(ex.self), &output, &output_size, &output_allocated);
+    add_field(6, &ex.children, sizeof(ex.children), &output, &output_size, &output_allocated);
+
+    if (has_exit_status) {
+        int32_t status = exit_status;
+        add_field(7, &status, sizeof(status), &output, &output_size, &output_allocated);
+    }
+
+    add_field(8, &now, sizeof(now), &output, &output_size, &output_allocated);
+
+    send_message(fd, output, output_size);
+    close(fd);
 }
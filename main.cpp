@@ -59,6 +59,8 @@ void usage() {
 
 
 int main(int argc, char **argv) {
+    logp::util::process_start_time = logp::util::monotonic_time();
+
     if (::isatty(1)) logp::util::use_ansi_colours = true;
 
     // Argument parsing
@@ -0,0 +1,179 @@
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <algorithm>
+
+#include "logp/util.h"
+#include "logp/passthroughwriter.h"
+
+
+namespace logp {
+
+
+// How long finish() waits for a stalled descriptor (a suspended terminal, a reader
+// that stopped reading) before the rest of the passthrough output is given up
+static const std::chrono::seconds finish_timeout(5);
+
+
+passthrough_writer::passthrough_writer(int fd_, policy pol_, size_t max_buffered_) : fd(fd_), pol(pol_), max_buffered(max_buffered_) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) can_stall = false;
+}
+
+
+passthrough_writer::policy passthrough_writer::parse_policy(std::string name) {
+    if (name == "block") return policy::block;
+    if (name == "drop") return policy::drop;
+    if (name == "buffer") return policy::buffer;
+
+    throw logp::error("unknown passthrough policy '", name, "' (expected block, drop or buffer)");
+}
+
+
+void passthrough_writer::run() {
+    t = std::thread([this]() {
+        while (1) {
+            std::string buf;
+
+            {
+                std::unique_lock<std::mutex> lock(m);
+
+                cv_data.wait(lock, [this]{ return queue.size() || finishing; });
+
+                if (!queue.size()) return;
+
+                // Coalesce everything pending into a single write
+                buf.swap(queue.front());
+                queue.pop_front();
+                while (queue.size()) {
+                    buf.append(queue.front());
+                    queue.pop_front();
+                }
+            }
+
+            size_t written = 0;
+            bool write_failed = false;
+            bool timed_out = false;
+
+            while (written < buf.size()) {
+                size_t len = buf.size() - written;
+
+                if (can_stall) {
+                    {
+                        std::unique_lock<std::mutex> lock(m);
+                        if (finishing && std::chrono::steady_clock::now() >= finish_deadline) {
+                            timed_out = true;
+                            break;
+                        }
+                    }
+
+                    // Waiting in poll() rather than write() lets finish() give up on
+                    // a descriptor that never drains. Once writable, PIPE_BUF bytes
+                    // can be written without blocking.
+                    struct pollfd p = { fd, POLLOUT, 0 };
+                    int ret = poll(&p, 1, 100);
+                    if (ret == 0 || (ret == -1 && errno == EINTR)) continue;
+                    if (ret == -1) {
+                        PRINT_WARNING << "unable to pass through output to fd " << fd << ", continuing to capture: " << strerror(errno);
+                        write_failed = true;
+                        break;
+                    }
+
+                    len = std::min(len, static_cast<size_t>(PIPE_BUF));
+                }
+
+                ssize_t ret = ::write(fd, buf.data() + written, len);
+                if (ret <= 0) {
+                    if (ret == -1 && errno == EINTR) continue;
+                    PRINT_WARNING << "unable to pass through output to fd " << fd << ", continuing to capture: " << strerror(errno);
+                    write_failed = true;
+                    break;
+                }
+                written += ret;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(m);
+                buffered -= buf.size();
+
+                if (timed_out) {
+                    PRINT_WARNING << "fd " << fd << " isn't keeping up, giving up on the remaining " << (buf.size() - written + buffered) << " bytes of passthrough output";
+                }
+
+                if (write_failed || timed_out) {
+                    failed = true;
+                    queue.clear();
+                    buffered = 0;
+                }
+            }
+
+            cv_space.notify_all();
+
+            if (timed_out) return;
+        }
+    });
+}
+
+
+void passthrough_writer::write(const char *data, size_t len) {
+    std::unique_lock<std::mutex> lock(m);
+
+    if (failed) return;
+
+    if (pol == policy::buffer) {
+        // Discard the oldest output not yet being written. What the writer thread
+        // has taken is counted in buffered too, so with a slow descriptor up to
+        // twice max_buffered can be held.
+        if (len > max_buffered) {
+            dropped += len - max_buffered;
+            data += len - max_buffered;
+            len = max_buffered;
+        }
+
+        while (queue.size() && buffered + len > max_buffered) {
+            dropped += queue.front().size();
+            buffered -= queue.front().size();
+            queue.pop_front();
+        }
+    } else if (buffered + len > max_buffered) {
+        if (pol == policy::drop) {
+            dropped += len;
+            return;
+        }
+
+        cv_space.wait(lock, [this, len]{ return buffered + len <= max_buffered || buffered == 0 || failed; });
+        if (failed) return;
+    }
+
+    queue.emplace_back(data, len);
+    buffered += len;
+
+    lock.unlock();
+    cv_data.notify_one();
+}
+
+
+void passthrough_writer::finish() {
+    {
+        std::unique_lock<std::mutex> lock(m);
+        if (!finishing) finish_deadline = std::chrono::steady_clock::now() + finish_timeout;
+        finishing = true;
+    }
+
+    cv_data.notify_one();
+
+    if (t.joinable()) t.join();
+
+    if (dropped) {
+        PRINT_WARNING << "dropped " << dropped << " bytes of output to fd " << fd << " because it couldn't keep up";
+        dropped = 0;
+    }
+}
+
+
+}
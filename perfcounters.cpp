@@ -0,0 +1,178 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include <string>
+#include <fstream>
+
+#include "logp/util.h"
+#include "logp/perfcounters.h"
+
+
+namespace logp {
+
+
+bool perf_counters::supported() {
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+perf_counters::~perf_counters() {
+    for (auto &c : counters) close(c.fd);
+}
+
+
+void perf_counters::prepare() {
+    if (pipe(sync_pipe)) throw logp::error("unable to create pipe: ", strerror(errno));
+
+    fcntl(sync_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sync_pipe[1], F_SETFD, FD_CLOEXEC);
+}
+
+
+void perf_counters::child() {
+    close(sync_pipe[1]);
+
+    char c;
+    while (::read(sync_pipe[0], &c, 1) == -1 && errno == EINTR) {}
+
+    close(sync_pipe[0]);
+}
+
+
+#ifdef __linux__
+
+static int open_counter(pid_t pid, uint32_t type, uint64_t config, bool user_only, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = user_only;
+
+    return syscall(__NR_perf_event_open, &attr, pid, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+#endif
+
+
+void perf_counters::open(pid_t pid) {
+#ifdef __linux__
+    static const struct {
+        const char *name;
+        uint32_t type;
+        uint64_t config;
+    } events[] = {
+        { "task_clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+        { "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+        { "cpu_migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+        { "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+        { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { "cache_references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+        { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    };
+
+    int cycles_fd = -1;
+
+    for (auto &e : events) {
+        // Instructions go in a group led by cycles, so both are on the PMU at the
+        // same time and ipc stays meaningful when the kernel multiplexes
+        bool want_group = e.type == PERF_TYPE_HARDWARE && e.config == PERF_COUNT_HW_INSTRUCTIONS && cycles_fd != -1;
+
+        int fd = open_counter(pid, e.type, e.config, user_only, want_group ? cycles_fd : -1);
+
+        if (fd == -1 && (errno == EACCES || errno == EPERM) && !user_only) {
+            // perf_event_paranoid 2 only allows user-mode counting
+            user_only = true;
+            fd = open_counter(pid, e.type, e.config, user_only, want_group ? cycles_fd : -1);
+        }
+
+        if (fd == -1 && want_group) {
+            PRINT_DEBUG << "unable to group perf counter " << e.name << " with cycles: " << strerror(errno);
+            want_group = false;
+            fd = open_counter(pid, e.type, e.config, user_only, -1);
+        }
+
+        if (fd == -1) {
+            PRINT_DEBUG << "unable to open perf counter " << e.name << ": " << strerror(errno);
+            continue;
+        }
+
+        if (e.type == PERF_TYPE_HARDWARE && e.config == PERF_COUNT_HW_CPU_CYCLES) cycles_fd = fd;
+        if (want_group) ipc_grouped = true;
+
+        counters.push_back({ e.name, fd });
+    }
+
+    if (counters.empty()) {
+        std::string paranoid;
+        std::ifstream("/proc/sys/kernel/perf_event_paranoid") >> paranoid;
+        PRINT_WARNING << "unable to open any perf counters (kernel.perf_event_paranoid is " << (paranoid.size() ? paranoid : "unknown") << ")";
+    }
+#else
+    (void)pid;
+#endif
+
+    // Let the job exec
+    close(sync_pipe[0]);
+    char c = 0;
+    if (write(sync_pipe[1], &c, 1) != 1) PRINT_ERROR << "unable to release job: " << strerror(errno);
+    close(sync_pipe[1]);
+}
+
+
+nlohmann::json perf_counters::read() {
+    nlohmann::json out = nlohmann::json::object();
+    if (counters.empty()) return out;
+
+    bool multiplexed = false;
+    bool ipc_scaled = false;
+
+    for (auto &c : counters) {
+        uint64_t values[3]; // value, time enabled, time running
+
+        if (::read(c.fd, values, sizeof(values)) != sizeof(values)) continue;
+
+        uint64_t value = values[0];
+
+        if (values[2] == 0) {
+            if (values[1]) continue; // never got scheduled onto the PMU
+        } else if (values[2] < values[1]) {
+            value = static_cast<uint64_t>(static_cast<double>(value) * values[1] / values[2]);
+            multiplexed = true;
+            if (!strcmp(c.name, "cycles") || !strcmp(c.name, "instructions")) ipc_scaled = true;
+        }
+
+        out[c.name] = value;
+    }
+
+    // Separately scaled estimates of the two can give a ratio no CPU could run at
+    if (out.count("cycles") && out.count("instructions") && out["cycles"].get<uint64_t>() && (ipc_grouped || !ipc_scaled)) {
+        out["ipc"] = static_cast<double>(out["instructions"].get<uint64_t>()) / out["cycles"].get<uint64_t>();
+    }
+
+    if (multiplexed) out["scaled"] = true;
+    if (user_only) out["user_only"] = true;
+
+    return out;
+}
+
+}
@@ -0,0 +1,504 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <math.h>
+
+#include <string>
+#include <algorithm>
+#include <vector>
+
+#include "logp/util.h"
+#include "logp/pipecapturer.h"
+
+
+namespace logp {
+
+static bool fifo_atexit_handler_registered = false;
+static std::vector<std::string> fifos_to_cleanup;
+
+
+// Moves a descriptor out of the way of the ones being set up in the child
+static int move_internal_fd(int fd, int min_fd) {
+    int new_fd = fcntl(fd, F_DUPFD, min_fd);
+    if (new_fd == -1) throw logp::error("unable to relocate capture descriptor: ", strerror(errno));
+    close(fd);
+    fcntl(new_fd, F_SETFD, FD_CLOEXEC);
+    return new_fd;
+}
+
+
+pipe_capturer::pipe_capturer(int fd_, int passthrough_fd, hoytech::timer &timer_, const capture_options &opts_, std::function<void(capture_chunk &)> data_cb_, std::function<void()> end_cb_)
+            : fd(fd_), timer(timer_), opts(opts_), data_cb(data_cb_), end_cb(end_cb_), head_remaining(opts_.head_bytes) {
+    if (pipe(pipe_descs) != 0) {
+        PRINT_ERROR << "unable to create descriptor capture pipe: " << strerror(errno);
+        exit(1);
+    }
+
+    pipe_descs[0] = move_internal_fd(pipe_descs[0], opts.min_internal_fd);
+    pipe_descs[1] = move_internal_fd(pipe_descs[1], opts.min_internal_fd);
+
+    if (passthrough_fd != -1) passthrough = std::unique_ptr<passthrough_writer>(new passthrough_writer(passthrough_fd, opts.passthrough_policy, opts.passthrough_buffer));
+}
+
+
+pipe_capturer::pipe_capturer(std::string fifo_path_, hoytech::timer &timer_, const capture_options &opts_, std::function<void(capture_chunk &)> data_cb_, std::function<void()> end_cb_)
+            : fd(-1), timer(timer_), opts(opts_), fifo_path(fifo_path_), data_cb(data_cb_), end_cb(end_cb_), head_remaining(opts_.head_bytes) {
+    struct stat st;
+
+    if (stat(fifo_path.c_str(), &st) == 0) {
+        if (!S_ISFIFO(st.st_mode)) throw logp::error("capture path '", fifo_path, "' exists and is not a FIFO");
+    } else {
+        if (mkfifo(fifo_path.c_str(), 0600) != 0) throw logp::error("unable to create FIFO '", fifo_path, "': ", strerror(errno));
+        fifo_created = true;
+
+        // logp usually leaves via exit(), so don't rely on the destructor to remove it
+        fifos_to_cleanup.push_back(fifo_path);
+
+        if (!fifo_atexit_handler_registered) {
+            fifo_atexit_handler_registered = true;
+
+            ::atexit([](){
+                for (auto &path : fifos_to_cleanup) unlink(path.c_str());
+            });
+        }
+    }
+
+    // Opening the read side non-blocking doesn't wait for a writer. Our own write
+    // side keeps the FIFO from reporting EOF until release() is called.
+    pipe_descs[0] = open(fifo_path.c_str(), O_RDONLY | O_NONBLOCK);
+    if (pipe_descs[0] == -1) throw logp::error("unable to open FIFO '", fifo_path, "': ", strerror(errno));
+
+    pipe_descs[1] = open(fifo_path.c_str(), O_WRONLY | O_NONBLOCK);
+    if (pipe_descs[1] == -1) throw logp::error("unable to open FIFO '", fifo_path, "' for writing: ", strerror(errno));
+
+    pipe_descs[0] = move_internal_fd(pipe_descs[0], opts.min_internal_fd);
+    pipe_descs[1] = move_internal_fd(pipe_descs[1], opts.min_internal_fd);
+
+    int flags = fcntl(pipe_descs[0], F_GETFL, 0);
+    if (flags == -1 || fcntl(pipe_descs[0], F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        throw logp::error("unable to make FIFO '", fifo_path, "' blocking: ", strerror(errno));
+    }
+}
+
+
+std::unique_ptr<pipe_capturer> pipe_capturer::adopt(int read_fd, int passthrough_fd, hoytech::timer &timer_, const capture_options &opts_, std::function<void(capture_chunk &)> data_cb_, std::function<void()> end_cb_) {
+    std::unique_ptr<pipe_capturer> pc(new pipe_capturer(timer_, opts_, data_cb_, end_cb_));
+
+    pc->pipe_descs[0] = move_internal_fd(read_fd, opts_.min_internal_fd);
+
+    if (passthrough_fd != -1) pc->passthrough = std::unique_ptr<passthrough_writer>(new passthrough_writer(passthrough_fd, opts_.passthrough_policy, opts_.passthrough_buffer));
+
+    return pc;
+}
+
+
+// Only once the capture has ended, or the reader thread would still be running
+pipe_capturer::~pipe_capturer() {
+    if (t.joinable()) t.join();
+
+    if (fifo_created) {
+        unlink(fifo_path.c_str());
+        fifos_to_cleanup.erase(std::remove(fifos_to_cleanup.begin(), fifos_to_cleanup.end(), fifo_path), fifos_to_cleanup.end());
+    }
+}
+
+
+void pipe_capturer::child() {
+    if (fd == -1) return; // FIFO and adopted descriptors are close-on-exec
+
+    dup2(pipe_descs[1], fd);
+    close(pipe_descs[0]);
+    close(pipe_descs[1]);
+    pipe_descs[0] = pipe_descs[1] = -1;
+}
+
+
+void pipe_capturer::release() {
+    if (fd != -1 || pipe_descs[1] == -1) return;
+
+    close(pipe_descs[1]);
+    pipe_descs[1] = -1;
+}
+
+
+void pipe_capturer::parent() {
+    if (fd != -1) {
+        close(pipe_descs[1]);
+        pipe_descs[1] = -1;
+    }
+
+    if (passthrough) passthrough->run();
+
+    read_buffer.resize(65536);
+
+    t = std::thread([this]() {
+        while(1) {
+            read_again:
+            ssize_t ret = ::read(pipe_descs[0], &read_buffer[0], read_buffer.size());
+            if (ret <= 0) {
+                if (ret == -1 && errno == EINTR) goto read_again;
+                pipe_closed();
+                return;
+            }
+
+            uint64_t timestamp = logp::util::curr_time();
+
+            if (passthrough) passthrough->write(read_buffer.data(), ret);
+
+            if (opts.head_bytes || opts.tail_bytes) retain_data(read_buffer.data(), ret, timestamp);
+            else new_data(read_buffer.data(), ret, timestamp);
+        }
+    });
+}
+
+
+void pipe_capturer::new_data(const char *data, size_t len, uint64_t timestamp) {
+    std::unique_lock<std::mutex> lock(pending_mutex);
+
+    update_rate(len, timestamp);
+    last_timestamp = timestamp;
+
+    if (opts.collapse != capture_options::collapse_mode::none) {
+        collapse_lines(data, len, timestamp);
+    } else {
+        if (!pending_buffer.size()) pending_timestamp = timestamp;
+        pending_buffer.append(data, len);
+
+        if (holds_partial_lines()) {
+            // When the line that's still incomplete started arriving
+            const char *p = data + len;
+            while (p > data && p[-1] != '\n') p--;
+            if (p != data) partial_since = p == data + len ? 0 : timestamp;
+            else if (!partial_since) partial_since = timestamp;
+        }
+
+        if (opts.lines) {
+            size_t newlines = logp::util::count_newlines(data, len);
+            if (newlines) pending_lines.push_back({ newlines, timestamp });
+        }
+    }
+
+    if (pending_buffer.size() >= opts.flush_bytes) flush_pending(false);
+
+    if (!has_pending()) return;
+
+    schedule_flush();
+}
+
+
+// In digits mode every run of digits becomes a single '#' before lines are
+// compared, so counters, timestamps and percentages don't defeat collapsing.
+static void normalize_digits(const char *p, size_t len, std::string &out) {
+    const char *end = p + len;
+    out.clear();
+
+    while (p < end) {
+        char c = *p++;
+
+        if (c >= '0' && c <= '9') {
+            while (p < end && *p >= '0' && *p <= '9') p++;
+            c = '#';
+        }
+
+        out.push_back(c);
+    }
+}
+
+
+// Must have lock on pending_mutex while calling
+void pipe_capturer::collapse_lines(const char *data, size_t len, uint64_t timestamp) {
+    bool digits = opts.collapse == capture_options::collapse_mode::digits;
+    const char *end = data + len;
+    uint64_t kept_lines = 0;
+
+    while (data < end) {
+        const char *newline = static_cast<const char *>(memchr(data, '\n', end - data));
+
+        if (!newline) {
+            partial_line.append(data, end - data);
+
+            // A line this long would never be collapsed usefully, and holding
+            // it would let output without newlines grow without bound
+            if (partial_line.size() >= opts.flush_bytes) take_partial_line();
+
+            break;
+        }
+
+        const char *line = data;
+        size_t line_len = newline + 1 - data;
+
+        if (partial_line.size()) {
+            partial_line.append(line, line_len);
+            line = partial_line.data();
+            line_len = partial_line.size();
+        }
+
+        const char *cmp = line;
+        size_t cmp_len = line_len;
+
+        if (digits) {
+            normalize_digits(line, line_len, normalized_line);
+            cmp = normalized_line.data();
+            cmp_len = normalized_line.size();
+        }
+
+        bool repeat = have_prev && cmp_len == prev_line.size() && memcmp(cmp, prev_line.data(), cmp_len) == 0;
+
+        if (repeat) {
+            if (!has_pending()) pending_timestamp = timestamp;
+            if (!repeat_count) repeat_first_timestamp = timestamp;
+            repeat_count++;
+            repeat_last_timestamp = timestamp;
+        } else {
+            end_repeat_run();
+
+            if (!pending_buffer.size() && !pending_repeats.size()) pending_timestamp = timestamp;
+            pending_buffer.append(line, line_len);
+            kept_lines++;
+
+            have_prev = true;
+            prev_line.assign(cmp, cmp_len);
+        }
+
+        partial_line.clear();
+        data = newline + 1;
+    }
+
+    if (opts.lines && kept_lines) pending_lines.push_back({ kept_lines, timestamp });
+}
+
+
+// Must have lock on pending_mutex while calling
+void pipe_capturer::end_repeat_run() {
+    if (!repeat_count) return;
+
+    pending_repeats.push_back({ pending_buffer.size(), repeat_count, repeat_first_timestamp, repeat_last_timestamp });
+    repeat_count = 0;
+}
+
+
+// Must have lock on pending_mutex while calling
+void pipe_capturer::take_partial_line() {
+    if (!partial_line.size()) return;
+
+    end_repeat_run();
+
+    if (!pending_buffer.size() && !pending_repeats.size()) pending_timestamp = last_timestamp;
+    pending_buffer.append(partial_line);
+    partial_line.clear();
+
+    // The rest of this line will arrive separately, so it can't be compared
+    have_prev = false;
+}
+
+
+// Whether flushes stop at the last newline. Collapse mode keeps partial lines out
+// of pending_buffer itself.
+bool pipe_capturer::holds_partial_lines() {
+    return (opts.flush_newline || opts.lines) && opts.collapse == capture_options::collapse_mode::none;
+}
+
+
+// Must have lock on pending_mutex while calling
+bool pipe_capturer::has_pending() {
+    return pending_buffer.size() || pending_repeats.size() || repeat_count || partial_line.size();
+}
+
+
+void pipe_capturer::retain_data(const char *data, size_t len, uint64_t timestamp) {
+    if (head_remaining) {
+        size_t head_len = std::min(len, head_remaining);
+        head_remaining -= head_len;
+        new_data(data, head_len, timestamp);
+        data += head_len;
+        len -= head_len;
+        if (!len) return;
+    }
+
+    std::unique_lock<std::mutex> lock(pending_mutex);
+
+    last_timestamp = timestamp;
+    tail_total += len;
+
+    if (!opts.tail_bytes) return;
+
+    if (tail_ring.size() < opts.tail_bytes) tail_ring.resize(opts.tail_bytes);
+
+    if (len > opts.tail_bytes) {
+        data += len - opts.tail_bytes;
+        len = opts.tail_bytes;
+    }
+
+    size_t first = std::min(len, opts.tail_bytes - tail_ring_pos);
+    memcpy(&tail_ring[tail_ring_pos], data, first);
+    memcpy(&tail_ring[0], data + first, len - first);
+    tail_ring_pos = (tail_ring_pos + len) % opts.tail_bytes;
+}
+
+
+// Must have lock on pending_mutex while calling
+void pipe_capturer::flush_retained() {
+    if (!tail_total) return;
+
+    capture_chunk c;
+    c.timestamp = last_timestamp;
+    c.tail = true;
+
+    size_t kept = static_cast<size_t>(std::min(tail_total, static_cast<uint64_t>(opts.tail_bytes)));
+    c.elided = tail_total - kept;
+
+    if (kept) {
+        if (tail_total < opts.tail_bytes) {
+            c.data = tail_ring.substr(0, kept);
+        } else {
+            c.data = tail_ring.substr(tail_ring_pos);
+            c.data.append(tail_ring, 0, tail_ring_pos);
+        }
+
+        if (opts.lines) {
+            size_t newlines = logp::util::count_newlines(c.data.data(), c.data.size());
+            if (newlines) c.lines.push_back({ newlines, last_timestamp });
+        }
+    }
+
+    data_cb(c);
+
+    tail_total = 0;
+}
+
+
+// Microseconds for the flush rate estimate to mostly forget old output. A 100ms
+// window gets a weight of 0.25.
+static const double rate_time_constant = 350*1000;
+
+
+// Must have lock on pending_mutex while calling
+void pipe_capturer::update_rate(size_t bytes, uint64_t timestamp) {
+    if (!rate_window_start) rate_window_start = timestamp;
+
+    rate_window_bytes += bytes;
+
+    uint64_t elapsed = timestamp - rate_window_start;
+    if (elapsed < 100*1000) return;
+
+    // Weighted by how long the window was rather than per window, so a burst
+    // followed by a long pause doesn't keep counting as fast output
+    double instantaneous = rate_window_bytes * 1000000.0 / elapsed;
+    double keep = exp(-static_cast<double>(elapsed) / rate_time_constant);
+    byte_rate = byte_rate * keep + instantaneous * (1 - keep);
+
+    rate_window_start = timestamp;
+    rate_window_bytes = 0;
+}
+
+
+// Must have lock on pending_mutex while calling
+uint64_t pipe_capturer::current_flush_delay() {
+    // How much we expect to accumulate if we wait the full delay. Jobs that won't
+    // come close to flush_bytes gain little from waiting, so flush them sooner.
+    // The rate decays while there's no output, as it would have been updated to.
+    uint64_t now = logp::util::curr_time();
+    double rate = byte_rate;
+    if (rate_window_start && now >= rate_window_start + 100*1000) rate *= exp(-static_cast<double>(now - rate_window_start) / rate_time_constant);
+
+    double expected_bytes = rate * opts.flush_max_delay / 1000000.0;
+    if (expected_bytes >= opts.flush_bytes) return opts.flush_max_delay;
+
+    uint64_t delay = static_cast<uint64_t>(opts.flush_max_delay * (expected_bytes / opts.flush_bytes));
+
+    return std::max(opts.flush_min_delay, std::min(opts.flush_max_delay, delay));
+}
+
+
+// Must have lock on pending_mutex while calling
+void pipe_capturer::schedule_flush() {
+    if (pending_timer_cancel_token) return;
+
+    uint64_t delay = current_flush_delay();
+
+    if (partial_since && pending_buffer.find('\n') == std::string::npos) {
+        // Only a held back partial line is pending, so there's nothing to do until it's due
+        uint64_t due = partial_since + opts.flush_max_delay;
+        uint64_t now = logp::util::curr_time();
+        if (due > now) delay = std::max(delay, due - now);
+    }
+
+    pending_timer_cancel_token = timer.once(delay, [this](){
+        std::unique_lock<std::mutex> lock(pending_mutex);
+        pending_timer_cancel_token = 0;
+        take_partial_line(); // don't hold prompts and progress output indefinitely
+        flush_pending(false);
+        if (has_pending()) schedule_flush();
+    });
+}
+
+
+// Must have lock on pending_mutex while calling
+void pipe_capturer::flush_pending(bool force) {
+    bool collapsing = opts.collapse != capture_options::collapse_mode::none;
+
+    if (collapsing) {
+        // Counts so far go out with this chunk; a continuing run is counted afresh
+        end_repeat_run();
+        if (force) take_partial_line();
+    }
+
+    size_t flush_len = pending_buffer.size();
+
+    if (holds_partial_lines() && !force && partial_since) {
+        // Hold back a trailing partial line until it has waited as long as any
+        // output would, so prompts and progress output still go out
+        size_t last_newline = pending_buffer.find_last_of('\n');
+        flush_len = last_newline == std::string::npos ? 0 : last_newline + 1;
+
+        if (pending_buffer.size() - flush_len >= opts.flush_bytes || logp::util::curr_time() >= partial_since + opts.flush_max_delay) {
+            flush_len = pending_buffer.size();
+        }
+    }
+
+    if (flush_len || pending_repeats.size()) {
+        capture_chunk c;
+        c.timestamp = pending_timestamp;
+
+        if (flush_len == pending_buffer.size()) {
+            c.data.swap(pending_buffer);
+            partial_since = 0; // the rest of the line will be a new partial line
+        } else {
+            c.data = pending_buffer.substr(0, flush_len);
+            pending_buffer.erase(0, flush_len);
+            pending_timestamp = partial_since;
+        }
+
+        // Any held back remainder is a partial line, so all complete lines go now
+        c.lines.swap(pending_lines);
+        c.repeats.swap(pending_repeats);
+
+        data_cb(c);
+    }
+
+    if (pending_timer_cancel_token && (force || !has_pending())) {
+        timer.cancel(pending_timer_cancel_token);
+        pending_timer_cancel_token = 0;
+    }
+}
+
+
+void pipe_capturer::pipe_closed() {
+    close(pipe_descs[0]);
+    pipe_descs[0] = -1;
+
+    {
+        std::unique_lock<std::mutex> lock(pending_mutex);
+        flush_pending(true);
+        flush_retained();
+    }
+
+    if (passthrough) passthrough->finish();
+    end_cb();
+}
+
+
+}
@@ -1,14 +1,20 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
 
 #include "logp/util.h"
 #include "logp/preloadwatcher.h"
@@ -19,6 +25,11 @@ namespace logp {
 bool atexit_handler_registered = false;
 std::vector<std::string> tmpdirs_to_cleanup;
 
+static const double poll_interval = 0.1; // seconds
+static const double exit_grace = 0.1; // seconds to wait for the shim's exit report after a pidfd fires
+
+static bool probe_pidfd();
+
 void preload_watcher::run() {
     char my_temp_dir[] = "/tmp/logp-XXXXXX";
     if (!mkdtemp(my_temp_dir)) throw logp::error("mkdtemp error: ", strerror(errno));
@@ -35,6 +46,8 @@ void preload_watcher::run() {
             for(auto &dir : tmpdirs_to_cleanup) {
                 std::string socket = dir + "/logp.socket";
                 unlink(socket.c_str());
+                std::string ring = dir + "/logp.ring";
+                unlink(ring.c_str());
                 rmdir(dir.c_str());
             }
         });
@@ -57,10 +70,17 @@ void preload_watcher::run() {
         throw logp::error("unable to listen on unix socket '", socket_path, "': ", strerror(errno));
     }
 
-    t = std::thread([this]() {
-        //ev::dynamic_loop loop(EVFLAG_NOSIGMASK);
-        loop = std::unique_ptr<ev::dynamic_loop>(new ev::dynamic_loop(EVFLAG_NOSIGMASK));
+    pidfd_supported = probe_pidfd();
+
+    loop = std::unique_ptr<ev::dynamic_loop>(new ev::dynamic_loop(EVFLAG_NOSIGMASK));
+
+    poll_timer = std::unique_ptr<ev::timer>(new ev::timer(*loop));
+    poll_timer->set<preload_watcher, &preload_watcher::poll_procs>(this);
+    poll_timer->start(poll_interval, poll_interval);
 
+    if (use_ring) setup_ring();
+
+    t = std::thread([this]() {
         ev::io accept_io(*loop);
 
         accept_io.set<preload_watcher, &preload_watcher::handle_accept>(this);
@@ -70,6 +90,330 @@ void preload_watcher::run() {
     });
 }
 
+
+#ifdef __linux__
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#endif
+
+static int pidfd_open(int pid) {
+#ifdef __linux__
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static bool probe_pidfd() {
+    int pidfd = pidfd_open(getpid());
+    if (pidfd == -1) return false;
+
+    close(pidfd);
+    return true;
+}
+
+
+// Exits are noticed through a pidfd per process where the kernel supports them
+// (Linux 5.3+). Otherwise processes are polled, and socket clients keep their
+// connection open until they exit. Either way the shim's exit message, with the
+// status and rusage, is what ends a process when there is one: after a pidfd
+// fires the end waits up to exit_grace for it to be read.
+//
+// Timestamps are taken by the shim, not when its messages are read. A process that
+// was forked well before it exec()ed (a shell setting up redirections, say) is dated
+// from its fork using the kernel's starttime. That is only as precise as a clock
+// tick, so the end of the tick is used, capped at the shim's constructor time.
+
+uint64_t preload_watcher::proc_started(uint64_t ts, nlohmann::json &data, uint64_t starttime) {
+    int pid = data.count("pid") ? data["pid"].get<int>() : -1;
+
+    // The same pid starting again means the previous image exec()ed
+    if (pid != -1 && procs.count(pid)) proc_exited(ts, pid);
+    else if (starttime) ts = std::min(ts, logp::util::proc_starttime_to_wall(starttime) + logp::util::proc_starttime_resolution());
+
+    if (on_proc_start) on_proc_start(ts, data);
+
+    if (pid == -1) return 0;
+
+    auto &proc = procs[pid];
+    proc.serial = next_proc_serial++;
+
+    if (pidfd_supported) {
+        int pidfd = pidfd_open(pid);
+
+        if (pidfd != -1) fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+
+        // A short-lived process can be gone before its start is read, with its exit report still to come
+        if (pidfd != -1 || errno == ESRCH) proc.exit_watch = std::unique_ptr<pidfd_watch>(new pidfd_watch(this, *loop, pid, proc.serial, pidfd));
+    }
+
+    return proc.serial;
+}
+
+
+// serial, if given, must match the start being ended. data holds anything the
+// shim reported at exit.
+void preload_watcher::proc_exited(uint64_t ts, int pid, uint64_t serial, nlohmann::json data) {
+    auto it = procs.find(pid);
+    if (it == procs.end() || (serial && it->second.serial != serial)) return;
+
+    procs.erase(it);
+
+    data["pid"] = pid;
+
+    if (on_proc_end) on_proc_end(ts, data);
+}
+
+
+// Same keys as the rusage of the run's cmd end entry
+static nlohmann::json usage_to_json(const char *p) {
+    struct logp_proc_usage u;
+    memcpy(&u, p, sizeof(u));
+
+    return nlohmann::json({
+        {"utime", u.utime},
+        {"stime", u.stime},
+        {"maxrss", u.maxrss},
+        {"minflt", u.minflt},
+        {"majflt", u.majflt},
+        {"inblock", u.inblock},
+        {"oublock", u.oublock},
+        {"nvcsw", u.nvcsw},
+        {"nivcsw", u.nivcsw},
+    });
+}
+
+
+void pidfd_watch::readable() {
+    io.stop();
+    exited_at = logp::util::curr_time();
+    grace.start(exit_grace, 0);
+}
+
+
+// Only without the shim's report (a static binary, a crash or _exit())
+void pidfd_watch::grace_expired() {
+    preload_watcher *p = parent;
+    int exited_pid = pid;
+    uint64_t exited_serial = serial;
+    uint64_t ts = exited_at;
+
+    // Either call can destroy this watch
+    p->drain_ring_events();
+    p->proc_exited(ts, exited_pid, exited_serial);
+}
+
+
+void preload_watcher::poll_procs() {
+    std::vector<int> gone;
+
+    for (auto &p : procs) {
+        if (!p.second.exit_watch && kill(p.first, 0) == -1 && errno == ESRCH) gone.push_back(p.first);
+    }
+
+    uint64_t now = logp::util::curr_time();
+
+    // Exit reports already decoded from the ring carry more than we know here
+    if (gone.size()) drain_ring_events();
+
+    for (int pid : gone) proc_exited(now, pid);
+}
+
+
+void preload_watcher::setup_ring() {
+#ifdef LOGP_RING_SUPPORTED
+    std::string path = temp_dir + "/logp.ring";
+
+    int ring_fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (ring_fd == -1) throw logp::error("unable to create ring '", path, "': ", strerror(errno));
+
+    size_t size = logp_ring_mapping_size();
+
+    if (ftruncate(ring_fd, size) == -1) {
+        close(ring_fd);
+        throw logp::error("unable to size ring '", path, "': ", strerror(errno));
+    }
+
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    close(ring_fd);
+    if (p == MAP_FAILED) throw logp::error("unable to map ring '", path, "': ", strerror(errno));
+
+    ring = static_cast<struct logp_ring_header *>(p);
+    ring->version = LOGP_RING_VERSION;
+    ring->data_size = LOGP_RING_DATA_SIZE;
+    __atomic_store_n(&ring->magic, LOGP_RING_MAGIC, __ATOMIC_RELEASE); // shim ignores the ring until this is set
+
+    ring_path = path;
+
+    ring_async = std::unique_ptr<ev::async>(new ev::async(*loop));
+    ring_async->set<preload_watcher, &preload_watcher::drain_ring_events>(this);
+    ring_async->start();
+
+    ring_thread = std::thread([this]() {
+        read_ring();
+    });
+#endif
+}
+
+
+// The ring thread only decodes records. Process state is kept by the loop thread.
+
+// A writer that reserved space but was killed before publishing would stall the
+// ring at its record, so while a reservation is outstanding the reader only sleeps
+// this long at a time.
+static const uint64_t ring_stall_check_interval = 100*1000;
+
+// Reservations still unpublished after this long are given up on, along with any
+// records reserved after them before the stall began (their sizes can't be found
+// without the first record's).
+static const uint64_t ring_stall_timeout = 1000*1000;
+
+void preload_watcher::read_ring() {
+#ifdef LOGP_RING_SUPPORTED
+    char *data = logp_ring_data(ring);
+    uint64_t cap = ring->data_size;
+    size_t undelivered = 0;
+    uint64_t stalled_since = 0;
+    uint64_t stalled_head = 0;
+
+    while (1) {
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        auto *r = reinterpret_cast<struct logp_ring_record *>(data + tail % cap);
+        uint32_t size = __atomic_load_n(&r->size, __ATOMIC_ACQUIRE);
+
+        if (size) {
+            stalled_since = 0;
+
+            // Processes can scribble on the ring, so the header is copied before it's
+            // checked and the payload is only read up to the length checked here
+            struct logp_ring_record rec;
+            memcpy(&rec, r, sizeof(rec));
+            rec.size = size;
+
+            bool corrupted = size % 8 || size > cap - tail % cap;
+            if (!corrupted && rec.type != LOGP_RING_PADDING) corrupted = size < sizeof(rec) || rec.payload_len > size - sizeof(rec);
+
+            if (corrupted) {
+                // Leave it to fill up so they fall back to the socket
+                PRINT_WARNING << "corrupted record in preload ring, no longer reading it";
+                return;
+            }
+
+            if (rec.type != LOGP_RING_PADDING) handle_ring_record(rec, reinterpret_cast<char *>(r) + sizeof(rec));
+
+            memset(r, 0, size);
+            __atomic_store_n(&ring->tail, tail + size, __ATOMIC_RELEASE);
+
+            if (++undelivered >= 256) {
+                ring_async->send();
+                undelivered = 0;
+            }
+
+            continue;
+        }
+
+        if (undelivered) {
+            ring_async->send();
+            undelivered = 0;
+        }
+
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            stalled_since = 0;
+        } else if (!stalled_since) {
+            stalled_since = logp::util::monotonic_time();
+            stalled_head = head;
+        } else if (logp::util::monotonic_time() - stalled_since >= ring_stall_timeout) {
+            PRINT_WARNING << "process reserved space in preload ring but never wrote its record, skipping " << (stalled_head - tail) << " bytes";
+
+            // Zeroed so the sizes read there later are only ever ones writers publish
+            uint64_t off = tail % cap;
+            uint64_t len = stalled_head - tail;
+            uint64_t first = std::min(len, cap - off);
+            memset(data + off, 0, first);
+            memset(data, 0, len - first);
+
+            __atomic_store_n(&ring->tail, stalled_head, __ATOMIC_RELEASE);
+            stalled_since = 0;
+            continue;
+        }
+
+        // Nothing published: sleep unless a writer got in before reader_waiting was seen
+        __atomic_store_n(&ring->reader_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (!__atomic_load_n(&r->size, __ATOMIC_ACQUIRE)) {
+            struct timespec timeout = { 0, static_cast<long>(ring_stall_check_interval * 1000) };
+            syscall(SYS_futex, &ring->reader_waiting, FUTEX_WAIT, 1, stalled_since ? &timeout : nullptr, nullptr, 0);
+        }
+
+        __atomic_store_n(&ring->reader_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+#endif
+}
+
+
+static void parse_argv(const char *p, size_t len, nlohmann::json &j) {
+    const char *end = p + len;
+
+    while (p < end) {
+        const char *nul = static_cast<const char *>(memchr(p, '\0', end - p));
+        if (!nul) nul = end;
+        j["argv"].push_back(std::string(p, nul - p));
+        p = nul + 1;
+    }
+}
+
+
+// r has been checked by read_ring(): payload_len bytes of payload are inside the record
+void preload_watcher::handle_ring_record(const struct logp_ring_record &r, const char *payload) {
+    ring_event e{ r.type, logp::util::monotonic_to_wall(r.timestamp), r.starttime, nlohmann::json({{ "pid", r.pid }}) };
+
+    size_t payload_len = r.payload_len;
+
+    if (r.type == LOGP_RING_PROC_START) {
+        e.data["ppid"] = r.ppid;
+        parse_argv(payload, payload_len, e.data);
+    } else if (r.type == LOGP_RING_PROC_EXIT) {
+        if (payload_len >= sizeof(struct logp_proc_exit)) {
+            struct logp_proc_exit ex;
+            memcpy(&ex, payload, sizeof(ex));
+
+            e.data["rusage"] = usage_to_json(payload + offsetof(struct logp_proc_exit, self));
+            e.data["rusage_children"] = usage_to_json(payload + offsetof(struct logp_proc_exit, children));
+
+            if (ex.has_status) {
+                e.data["term"] = "exit";
+                e.data["exit"] = ex.status;
+            }
+        }
+    } else {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(ring_events_mutex);
+    ring_events.push_back(std::move(e));
+}
+
+
+void preload_watcher::drain_ring_events() {
+    std::vector<ring_event> events;
+
+    {
+        std::unique_lock<std::mutex> lock(ring_events_mutex);
+        events.swap(ring_events);
+    }
+
+    for (auto &e : events) {
+        if (e.type == LOGP_RING_PROC_START) proc_started(e.ts, e.data, e.starttime);
+        else proc_exited(e.ts, e.data["pid"], 0, e.data);
+    }
+}
+
+
 void preload_watcher::handle_accept(ev::io &, int) {
     int conn_fd = ::accept(fd, nullptr, nullptr);
 
@@ -81,82 +425,120 @@ void preload_watcher::handle_accept(ev::io &, int) {
 }
 
 
+// Messages on the socket are framed as a size_t total length (including the length
+// itself) followed by fields, each a uint16_t type, a size_t length and the data.
+// Several messages may arrive on one connection and a message may span reads, so
+// complete messages are decoded in place from the buffer and the rest is kept.
+
+static const size_t max_message_size = 16*1024*1024;
+
 void preload_connection::readable() {
-    char tmpbuf[4096];
-    auto ret = read(fd, tmpbuf, sizeof(tmpbuf));
+    size_t used = buffer.size();
+    buffer.resize(used + 4096);
+    auto ret = read(fd, &buffer[used], 4096);
+    buffer.resize(used + (ret > 0 ? ret : 0));
+
+    if (ret < 0 && (errno == EINTR || errno == EAGAIN)) return;
 
     if (ret <= 0) {
-        uint64_t end_ts = logp::util::curr_time();;
+        closed(logp::util::curr_time());
+        return;
+    }
 
-        auto j = nlohmann::json({
-            {"pid", pid}
-        });
+    uint64_t now = logp::util::curr_time();
 
-        if (parent->on_proc_end) parent->on_proc_end(end_ts, j);
+    while (buffer.size() - consumed >= sizeof(size_t)) {
+        size_t msg_len;
+        memcpy(&msg_len, buffer.data() + consumed, sizeof(size_t));
 
-        parent->conn_map.erase(fd);
-        return;
+        if (msg_len < sizeof(size_t) || msg_len > max_message_size) {
+            PRINT_WARNING << "bad message length from preload connection, closing it";
+            closed(now);
+            return;
+        }
+
+        if (buffer.size() - consumed < msg_len) break;
+
+        handle_message(buffer.data() + consumed + sizeof(size_t), msg_len - sizeof(size_t), now);
+        consumed += msg_len;
     }
 
-    if (start_ts == 0) start_ts = logp::util::curr_time();
+    if (consumed == buffer.size()) {
+        buffer.clear();
+        consumed = 0;
+    } else if (consumed >= 64*1024) {
+        buffer.erase(0, consumed);
+        consumed = 0;
+    }
+}
 
-    buffer += std::string(tmpbuf, (size_t)ret);
 
-    if (buffer.size() >= sizeof(size_t)) {
-        size_t msg_len;
-        memcpy(&msg_len, buffer.data(), sizeof(size_t));
-        if (buffer.size() < msg_len) return;
-
-        nlohmann::json j;
-
-        std::string payload = buffer.substr(sizeof(size_t));
-        size_t curr_offset = 0;
-
-        while(1) {
-            std::string type_str = payload.substr(curr_offset, sizeof(uint16_t));
-            if (type_str.size() != sizeof(uint16_t)) break;
-            uint16_t field_type;
-            memcpy(&field_type, type_str.data(), sizeof(uint16_t));
-            curr_offset += sizeof(uint16_t);
-
-            std::string len_str = payload.substr(curr_offset, sizeof(size_t));
-            if (len_str.size() != sizeof(size_t)) break;
-            size_t field_len;
-            memcpy(&field_len, len_str.data(), sizeof(size_t));
-            curr_offset += sizeof(size_t);
-
-            std::string field = payload.substr(curr_offset, field_len);
-            if (field.size() != field_len) break;
-            curr_offset += field_len;
-
-            if (field_type == 1) {
-                if (field.size() == sizeof(pid_t)) {
-                    pid_t pid;
-                    memcpy(&pid, field.data(), sizeof(pid_t));
-                    j["pid"] = pid;
-                }
-            } else if (field_type == 2) {
-                if (field.size() == sizeof(pid_t)) {
-                    pid_t pid;
-                    memcpy(&pid, field.data(), sizeof(pid_t));
-                    j["ppid"] = pid;
-                }
-            } else if (field_type == 3) {
-                size_t i = 0, pos = field.find('\0');
-                while (pos != std::string::npos) {
-                    j["argv"].push_back(field.substr(i, pos-i));
-                    i = ++pos;
-                    pos = field.find('\0', pos);
-
-                    if (pos == std::string::npos) j["argv"].push_back(field.substr(i, field.length()));
-                }
+void preload_connection::handle_message(const char *p, size_t len, uint64_t now) {
+    const char *end = p + len;
+    uint16_t kind = preload_message_start;
+    uint64_t ts = now, starttime = 0;
+    nlohmann::json j;
+
+    while (static_cast<size_t>(end - p) >= sizeof(uint16_t) + sizeof(size_t)) {
+        uint16_t field_type;
+        size_t field_len;
+
+        memcpy(&field_type, p, sizeof(uint16_t));
+        p += sizeof(uint16_t);
+        memcpy(&field_len, p, sizeof(size_t));
+        p += sizeof(size_t);
+
+        if (field_len > static_cast<size_t>(end - p)) break;
+
+        const char *field = p;
+        p += field_len;
+
+        if (field_type == 1 || field_type == 2) {
+            if (field_len == sizeof(pid_t)) {
+                pid_t field_pid;
+                memcpy(&field_pid, field, sizeof(pid_t));
+                j[field_type == 1 ? "pid" : "ppid"] = field_pid;
+            }
+        } else if (field_type == 3) {
+            parse_argv(field, field_len, j);
+        } else if (field_type == 4) {
+            if (field_len == sizeof(uint16_t)) memcpy(&kind, field, sizeof(uint16_t));
+        } else if (field_type == 5 || field_type == 6) {
+            if (field_len == sizeof(struct logp_proc_usage)) j[field_type == 5 ? "rusage" : "rusage_children"] = usage_to_json(field);
+        } else if (field_type == 7) {
+            if (field_len == sizeof(int32_t)) {
+                int32_t status;
+                memcpy(&status, field, sizeof(int32_t));
+                j["term"] = "exit";
+                j["exit"] = status;
+            }
+        } else if (field_type == 8) {
+            uint64_t monotonic;
+            if (field_len == sizeof(uint64_t)) {
+                memcpy(&monotonic, field, sizeof(uint64_t));
+                ts = logp::util::monotonic_to_wall(monotonic);
             }
+        } else if (field_type == 9) {
+            if (field_len == sizeof(uint64_t)) memcpy(&starttime, field, sizeof(uint64_t));
         }
+    }
 
+    if (kind == preload_message_start) {
         if (j.count("pid")) pid = j["pid"];
-
-        if (parent->on_proc_start) parent->on_proc_start(start_ts, j);
+        proc_serial = parent->proc_started(ts, j, starttime);
+    } else if (kind == preload_message_exit) {
+        if (pid == -1 && j.count("pid")) pid = j["pid"]; // reconnected just to report the exit
+        if (pid != -1) parent->proc_exited(ts, pid, proc_serial, j);
     }
 }
 
+
+// Erases the connection, so return straight away after calling
+void preload_connection::closed(uint64_t now) {
+    // With pidfds the shim hangs up as soon as its start is sent
+    if (pid != -1 && !parent->pidfd_supported) parent->proc_exited(now, pid, proc_serial);
+
+    parent->conn_map.erase(fd);
+}
+
 }
@@ -0,0 +1,169 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "logp/procagg.h"
+
+
+namespace logp {
+
+
+static std::string argv0(nlohmann::json &data) {
+    if (!data.count("argv") || !data["argv"].is_array() || !data["argv"].size()) return "";
+    return data["argv"][0];
+}
+
+
+void proc_aggregator::started(uint64_t ts, nlohmann::json &data) {
+    if (!data.count("pid")) {
+        if (on_start) on_start(ts, data);
+        return;
+    }
+
+    int pid = data["pid"];
+    int ppid = data.count("ppid") ? data["ppid"].get<int>() : -1;
+
+    std::string exe = argv0(data);
+    live_exe[pid] = exe;
+
+    // Children of a reported process are grouped under it, otherwise under the
+    // parent's executable
+    nlohmann::json group_data = {{ "exe", exe }};
+    std::string key = exe + '\0';
+
+    if (individual.count(ppid)) {
+        group_data["ppid"] = ppid;
+        key += std::to_string(ppid);
+    } else {
+        std::string parent_exe = live_exe.count(ppid) ? live_exe[ppid] : "";
+        group_data["parent_exe"] = parent_exe;
+        key += '\0' + parent_exe;
+    }
+
+    auto &g = groups[key];
+    if (g.data.is_null()) {
+        g.data = group_data;
+        g.data["argv"] = data["argv"];
+    }
+    g.pending++;
+
+    if (!window_start) window_start = ts;
+
+    auto &p = pending[pid];
+    p.start = ts;
+    p.data = std::move(data);
+    p.group_key = key;
+}
+
+
+void proc_aggregator::exited(uint64_t ts, nlohmann::json &data) {
+    int pid = data.count("pid") ? data["pid"].get<int>() : -1;
+
+    live_exe.erase(pid);
+
+    auto it = pending.find(pid);
+
+    if (it == pending.end()) {
+        individual.erase(pid);
+        if (on_end) on_end(ts, data);
+        return;
+    }
+
+    auto &p = it->second;
+    bool known_status = data.count("exit") && data["exit"].is_number();
+
+    if (known_status && data["exit"].get<int>() != 0) {
+        // Failures are always worth seeing on their own
+        report_individually(it);
+        individual.erase(pid);
+        if (on_end) on_end(ts, data);
+        return;
+    }
+
+    auto &g = groups[p.group_key];
+    uint64_t runtime = ts > p.start ? ts - p.start : 0;
+
+    g.pending--;
+
+    if (!g.count) g.first_start = p.start;
+    g.last_end = std::max(g.last_end, ts);
+    g.count++;
+    g.runtime_total += runtime;
+    g.runtime_max = std::max(g.runtime_max, runtime);
+    g.exits[known_status ? std::to_string(data["exit"].get<int>()) : "?"]++;
+
+    pending.erase(it);
+}
+
+
+// Erases it from pending
+void proc_aggregator::report_individually(std::unordered_map<int, pending_proc>::iterator it) {
+    auto &p = it->second;
+
+    groups[p.group_key].pending--;
+    individual.insert(it->first);
+
+    if (on_start) on_start(p.start, p.data);
+
+    pending.erase(it);
+}
+
+
+void proc_aggregator::tick(uint64_t now) {
+    std::vector<int> long_lived;
+
+    for (auto &p : pending) {
+        if (now - p.second.start >= min_runtime) long_lived.push_back(p.first);
+    }
+
+    // In start order, so parents are reported before their children
+    std::sort(long_lived.begin(), long_lived.end(), [this](int a, int b){ return pending[a].start < pending[b].start; });
+
+    for (int pid : long_lived) report_individually(pending.find(pid));
+
+    if (window_start && now - window_start >= interval) emit_rollups(now);
+}
+
+
+void proc_aggregator::flush(uint64_t now) {
+    // Whatever is still running gets reported, parents first
+    std::vector<int> running;
+    for (auto &p : pending) running.push_back(p.first);
+    std::sort(running.begin(), running.end(), [this](int a, int b){ return pending[a].start < pending[b].start; });
+
+    for (int pid : running) report_individually(pending.find(pid));
+
+    emit_rollups(now);
+}
+
+
+void proc_aggregator::emit_rollups(uint64_t now) {
+    for (auto it = groups.begin(); it != groups.end(); ) {
+        auto &g = it->second;
+
+        if (!g.count) {
+            // Groups with members still pending are needed when they exit
+            if (g.pending) ++it;
+            else it = groups.erase(it);
+            continue;
+        }
+
+        nlohmann::json data = g.data;
+        data["what"] = "aggregate";
+        data["count"] = g.count;
+        data["until"] = g.last_end;
+        data["runtime_total"] = g.runtime_total;
+        data["runtime_max"] = g.runtime_max;
+        for (auto &e : g.exits) data["exits"][e.first] = e.second;
+
+        if (on_rollup) on_rollup(g.first_start, data);
+
+        g.count = g.runtime_total = g.runtime_max = 0;
+        g.exits.clear();
+        ++it;
+    }
+
+    window_start = now;
+}
+
+}
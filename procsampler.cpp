@@ -0,0 +1,210 @@
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "logp/util.h"
+#include "logp/procsampler.h"
+
+
+namespace logp {
+
+
+bool proc_sampler::supported() {
+    return access("/proc/self/stat", R_OK) == 0;
+}
+
+
+void proc_sampler::run(pid_t root_pid) {
+    root = root_pid;
+    add(root);
+
+    t = std::thread([this]() {
+        uint64_t wait = interval;
+
+        std::unique_lock<std::mutex> lock(m);
+
+        while (1) {
+            cv.wait_for(lock, std::chrono::microseconds(wait), [this]{ return stopping; });
+            if (stopping) break;
+
+            uint64_t begin = logp::util::monotonic_time();
+            sample(lock);
+            uint64_t cost = logp::util::monotonic_time() - begin;
+
+            wait = std::min(std::max(interval, cost * 100), max_interval);
+        }
+    });
+}
+
+
+void proc_sampler::stop() {
+    {
+        std::unique_lock<std::mutex> lock(m);
+        stopping = true;
+    }
+
+    cv.notify_all();
+    if (t.joinable()) t.join();
+}
+
+
+// Processes are dropped once they can't be read, so nothing needs removing
+void proc_sampler::add(pid_t pid) {
+    std::unique_lock<std::mutex> lock(m);
+    procs.emplace(pid, sampled_proc());
+}
+
+
+nlohmann::json proc_sampler::take(uint64_t &ts) {
+    std::unique_lock<std::mutex> lock(m);
+    if (pending.empty()) return nullptr;
+
+    ts = pending[0].ts;
+    return encode();
+}
+
+
+// Called with the lock held, which is released while /proc is read
+void proc_sampler::sample(std::unique_lock<std::mutex> &lock) {
+    std::vector<std::pair<pid_t, sampled_proc>> current(procs.begin(), procs.end());
+
+    lock.unlock();
+
+    totals sum;
+    sum.ts = logp::util::curr_time();
+
+    std::vector<pid_t> gone;
+
+    for (auto &p : current) {
+        if (!read_proc(p.first, p.second, sum)) gone.push_back(p.first);
+    }
+
+    lock.lock();
+
+    for (auto &p : current) {
+        auto it = procs.find(p.first);
+        if (it != procs.end()) it->second = p.second;
+    }
+
+    for (auto pid : gone) procs.erase(pid);
+
+    samples++;
+    pending.push_back(sum);
+
+    if (pending.size() < batch) return;
+
+    uint64_t ts = pending[0].ts;
+    nlohmann::json data = encode();
+    batches++;
+
+    lock.unlock();
+    if (on_samples) on_samples(ts, data);
+    lock.lock();
+}
+
+
+bool proc_sampler::read_proc(pid_t pid, sampled_proc &p, totals &sum) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    if (!logp::util::read_file(path, buf)) return false;
+
+    // The command name is in parentheses and may itself contain spaces and parentheses
+    size_t paren = buf.rfind(')');
+    if (paren == std::string::npos || paren + 2 >= buf.size()) return false;
+
+    uint64_t utime = 0, stime = 0, starttime = 0, rss = 0;
+
+    // Fields are numbered from 1 (the pid); c is at field 3, the state
+    const char *c = buf.c_str() + paren + 2;
+
+    for (int field = 3; *c && field <= 24; field++) {
+        if (field > 3) {
+            uint64_t v = strtoull(c, nullptr, 10);
+
+            switch (field) {
+                case 14: utime = v; break;
+                case 15: stime = v; break;
+                case 22: starttime = v; break;
+                case 24: rss = v; break;
+            }
+        }
+
+        c = strchr(c, ' ');
+        if (!c) break;
+        c++;
+    }
+
+    if (p.starttime && p.starttime != starttime) return false; // the pid was reused
+    p.starttime = starttime;
+
+    static const uint64_t page_kb = sysconf(_SC_PAGESIZE) / 1024;
+
+    sum.procs++;
+    sum.rss += rss * page_kb;
+    sum.cpu += (utime + stime - std::min(p.cpu, utime + stime)) * logp::util::proc_starttime_resolution();
+    p.cpu = utime + stime;
+
+    // Only readable for processes of the same user, and not in every kernel
+    snprintf(path, sizeof(path), "/proc/%d/io", pid);
+
+    if (logp::util::read_file(path, buf)) {
+        const char *rd = strstr(buf.c_str(), "\nread_bytes: ");
+        const char *wr = strstr(buf.c_str(), "\nwrite_bytes: ");
+
+        if (rd) {
+            uint64_t v = strtoull(rd + 13, nullptr, 10);
+            sum.rd += v - std::min(p.rd, v);
+            p.rd = v;
+        }
+
+        if (wr) {
+            uint64_t v = strtoull(wr + 14, nullptr, 10);
+            sum.wr += v - std::min(p.wr, v);
+            p.wr = v;
+        }
+    }
+
+    return true;
+}
+
+
+// Clears pending
+nlohmann::json proc_sampler::encode() {
+    nlohmann::json data = {{ "what", "samples" }};
+
+    auto &ts = data["t"] = nlohmann::json::array();
+    auto &nprocs = data["procs"] = nlohmann::json::array();
+    auto &rss = data["rss"] = nlohmann::json::array();
+    auto &cpu = data["cpu"] = nlohmann::json::array();
+    auto &rd = data["rd"] = nlohmann::json::array();
+    auto &wr = data["wr"] = nlohmann::json::array();
+
+    totals last;
+    last.ts = pending[0].ts;
+
+    for (auto &s : pending) {
+        ts.push_back((s.ts - last.ts) / 1000);
+        nprocs.push_back(static_cast<int64_t>(s.procs - last.procs));
+        rss.push_back(static_cast<int64_t>(s.rss - last.rss));
+        cpu.push_back(s.cpu);
+        rd.push_back(s.rd);
+        wr.push_back(s.wr);
+
+        // Keep the rounding of t from accumulating
+        uint64_t ts_ms = last.ts + (s.ts - last.ts) / 1000 * 1000;
+        last = s;
+        last.ts = ts_ms;
+    }
+
+    pending.clear();
+
+    return data;
+}
+
+}
@@ -0,0 +1,264 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "logp/proctree.h"
+
+
+namespace logp {
+
+
+static const size_t max_cmd_len = 200;
+
+static std::string cmd_string(nlohmann::json &data) {
+    std::string cmd;
+    if (!data.count("argv") || !data["argv"].is_array()) return cmd;
+
+    for (auto &a : data["argv"]) {
+        if (!a.is_string()) continue;
+        if (cmd.size()) cmd += ' ';
+        cmd += a.get<std::string>();
+
+        if (cmd.size() > max_cmd_len) {
+            cmd.resize(max_cmd_len);
+            cmd += "...";
+            break;
+        }
+    }
+
+    return cmd;
+}
+
+static uint64_t usage_cpu(nlohmann::json &data, const char *key) {
+    if (!data.count(key) || !data[key].is_object()) return 0;
+
+    auto &u = data[key];
+    uint64_t cpu = 0;
+    if (u.count("utime") && u["utime"].is_number()) cpu += u["utime"].get<uint64_t>();
+    if (u.count("stime") && u["stime"].is_number()) cpu += u["stime"].get<uint64_t>();
+
+    return cpu;
+}
+
+
+void proc_tree::started(uint64_t ts, nlohmann::json &data) {
+    if (!data.count("evpid")) return;
+
+    uint64_t evpid = data["evpid"];
+
+    auto &n = nodes[evpid];
+    n.start = ts;
+    n.cmd = cmd_string(data);
+
+    auto parent = data.count("evppid") ? nodes.find(data["evppid"].get<uint64_t>()) : nodes.end();
+
+    if (parent != nodes.end()) {
+        parent->second.children.push_back(evpid);
+    } else {
+        roots.push_back(evpid);
+    }
+}
+
+
+void proc_tree::ended(uint64_t ts, nlohmann::json &data) {
+    if (!data.count("evpid")) return;
+
+    auto it = nodes.find(data["evpid"].get<uint64_t>());
+    if (it == nodes.end() || it->second.ended) return;
+
+    auto &n = it->second;
+    n.end = std::max(ts, n.start);
+    n.ended = true;
+    n.cpu = usage_cpu(data, "rusage");
+    n.children_cpu = usage_cpu(data, "rusage_children");
+}
+
+
+void proc_tree::rollup(uint64_t ts, nlohmann::json &data) {
+    uint64_t id = next_rollup_id--;
+
+    auto &n = nodes[id];
+    n.start = ts;
+    n.end = data.count("until") ? std::max(data["until"].get<uint64_t>(), ts) : ts;
+    n.ended = true;
+    n.cmd = cmd_string(data);
+    n.aggregate = true;
+    n.count = data.count("count") ? data["count"].get<uint64_t>() : 0;
+    n.runtime_total = data.count("runtime_total") ? data["runtime_total"].get<uint64_t>() : 0;
+
+    auto parent = data.count("evppid") ? nodes.find(data["evppid"].get<uint64_t>()) : nodes.end();
+
+    if (parent != nodes.end()) {
+        parent->second.children.push_back(id);
+    } else {
+        roots.push_back(id);
+    }
+}
+
+
+uint64_t proc_tree::wall(const proc_node &n, uint64_t job_end) {
+    if (n.aggregate) return n.runtime_total;
+
+    uint64_t end = n.ended ? n.end : std::max(job_end, n.start);
+    return end - n.start;
+}
+
+
+proc_tree::subtree_totals proc_tree::total(uint64_t id, uint64_t job_end) {
+    auto cached = totals.find(id);
+    if (cached != totals.end()) return cached->second;
+
+    auto &n = nodes.at(id);
+
+    subtree_totals t;
+    t.procs = n.count;
+    t.wall = wall(n, job_end);
+
+    uint64_t children_cpu = 0;
+
+    for (auto child : n.children) {
+        auto c = total(child, job_end);
+        t.procs += c.procs;
+        t.wall += c.wall;
+        children_cpu += c.cpu;
+    }
+
+    t.cpu = n.cpu + std::max(children_cpu, n.children_cpu);
+
+    totals[id] = t;
+    return t;
+}
+
+
+nlohmann::json proc_tree::describe(uint64_t id, uint64_t job_end) {
+    auto &n = nodes.at(id);
+
+    nlohmann::json data = {{ "cmd", n.cmd }, { "start", n.start }, { "wall", wall(n, job_end) }};
+
+    if (n.aggregate) {
+        data["aggregate"] = true;
+        data["count"] = n.count;
+    } else {
+        data["evpid"] = id;
+        data["cpu"] = n.cpu;
+        if (!n.ended) data["running"] = true;
+    }
+
+    return data;
+}
+
+
+nlohmann::json proc_tree::subtree(uint64_t id, size_t depth, uint64_t job_end) {
+    auto &n = nodes.at(id);
+    auto t = total(id, job_end);
+
+    nlohmann::json data = describe(id, job_end);
+    data["procs"] = t.procs;
+    data["wall_total"] = t.wall;
+    data["cpu_total"] = t.cpu;
+
+    if (depth >= max_depth) return data;
+
+    nlohmann::json below = subtrees(n.children, depth + 1, job_end);
+    for (auto it = below.begin(); it != below.end(); ++it) data[it.key()] = it.value();
+
+    return data;
+}
+
+
+// The top_n largest by wall time in "children", the rest summed up in "other"
+nlohmann::json proc_tree::subtrees(std::vector<uint64_t> ids, size_t depth, uint64_t job_end) {
+    nlohmann::json data = nlohmann::json::object();
+
+    for (auto id : ids) total(id, job_end);
+    std::sort(ids.begin(), ids.end(), [&](uint64_t a, uint64_t b){ return totals[a].wall > totals[b].wall; });
+
+    subtree_totals other;
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (i < top_n) {
+            data["children"].push_back(subtree(ids[i], depth, job_end));
+        } else {
+            auto &c = totals[ids[i]];
+            other.procs += c.procs;
+            other.wall += c.wall;
+            other.cpu += c.cpu;
+        }
+    }
+
+    if (other.procs) data["other"] = {{ "procs", other.procs }, { "wall_total", other.wall }, { "cpu_total", other.cpu }};
+
+    return data;
+}
+
+
+nlohmann::json proc_tree::summary(uint64_t job_end) {
+    totals.clear();
+
+    subtree_totals all;
+    uint64_t running = 0;
+
+    for (auto id : roots) {
+        auto t = total(id, job_end);
+        all.procs += t.procs;
+        all.wall += t.wall;
+        all.cpu += t.cpu;
+    }
+
+    for (auto &n : nodes) {
+        if (!n.second.ended) running++;
+    }
+
+    nlohmann::json data = {{ "what", "profile" }, { "procs", all.procs }, { "running", running },
+                           { "wall_total", all.wall }, { "cpu_total", all.cpu }};
+
+    // Critical path: from the root that finished last, follow whichever child
+    // finished last, ignoring children that outlived their parent since it didn't
+    // wait for them. "self" is the part of each step not spent on the next.
+    auto finished = [&](uint64_t id){
+        auto &n = nodes.at(id);
+        return n.ended ? n.end : std::max(job_end, n.start);
+    };
+
+    auto last_finished = [&](const std::vector<uint64_t> &ids, uint64_t by){
+        uint64_t best = 0;
+        for (auto id : ids) {
+            if (nodes.at(id).aggregate || finished(id) > by) continue;
+            if (!best || finished(id) > finished(best)) best = id;
+        }
+        return best;
+    };
+
+    data["critical_path"] = nlohmann::json::array();
+
+    for (uint64_t id = last_finished(roots, UINT64_MAX); id; ) {
+        uint64_t next = last_finished(nodes.at(id).children, finished(id));
+
+        auto step = describe(id, job_end);
+        step["self"] = step["wall"].get<uint64_t>() - (next ? std::min(wall(nodes.at(next), job_end), step["wall"].get<uint64_t>()) : 0);
+        data["critical_path"].push_back(step);
+
+        id = next;
+    }
+
+    std::vector<uint64_t> slowest;
+    for (auto &n : nodes) {
+        if (!n.second.aggregate) slowest.push_back(n.first);
+    }
+
+    size_t slowest_n = std::min(top_n, slowest.size());
+    std::partial_sort(slowest.begin(), slowest.begin() + slowest_n, slowest.end(), [&](uint64_t a, uint64_t b){
+        return wall(nodes.at(a), job_end) > wall(nodes.at(b), job_end);
+    });
+
+    data["slowest"] = nlohmann::json::array();
+    for (size_t i = 0; i < slowest_n; i++) data["slowest"].push_back(describe(slowest[i], job_end));
+
+    nlohmann::json tree = subtrees(roots, 0, job_end);
+    data["subtrees"] = tree.count("children") ? tree["children"] : nlohmann::json::array();
+    if (tree.count("other")) data["other"] = tree["other"];
+
+    return data;
+}
+
+}
@@ -0,0 +1,296 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "logp/util.h"
+#include "logp/procwatcher.h"
+
+
+namespace logp {
+
+
+bool proc_watcher::supported() {
+    std::string path = std::string("/proc/self/task/") + std::to_string(getpid()) + "/children";
+    return access(path.c_str(), R_OK) == 0;
+}
+
+
+void proc_watcher::run(pid_t root_pid) {
+    root = root_pid;
+
+    proc_stat self;
+    if (read_stat(getpid(), self)) self_comm = self.comm;
+
+    t = std::thread([this]() {
+        uint64_t interval = min_interval;
+        uint64_t generation = 0;
+
+        std::unique_lock<std::mutex> lock(m);
+
+        while (1) {
+            // Sleep first: the job has only just been forked and probably hasn't exec'ed yet
+            cv.wait_for(lock, std::chrono::microseconds(interval), [this]{ return stopping; });
+            if (stopping) break;
+
+            lock.unlock();
+            bool changed = scan(++generation);
+            lock.lock();
+
+            if (procs.empty() && generation > 1) break; // whole tree has exited
+
+            interval = changed ? min_interval : std::min(interval * 2, max_interval);
+        }
+    });
+}
+
+
+void proc_watcher::stop() {
+    {
+        std::unique_lock<std::mutex> lock(m);
+        stopping = true;
+    }
+
+    cv.notify_all();
+    if (t.joinable()) t.join();
+}
+
+
+bool proc_watcher::scan(uint64_t generation) {
+    uint64_t now = logp::util::curr_time();
+    bool changed = false;
+
+    scans++;
+
+    visit(root, generation, now, changed);
+
+    // Processes whose parent exited have been re-parented out of the tree, but
+    // are still part of the job
+    std::vector<pid_t> orphans;
+
+    for (auto &p : procs) {
+        if (p.second.generation != generation) orphans.push_back(p.first);
+    }
+
+    for (auto pid : orphans) {
+        if (procs.count(pid) && procs[pid].generation != generation) visit(pid, generation, now, changed);
+    }
+
+    return changed;
+}
+
+
+void proc_watcher::visit(pid_t pid, uint64_t generation, uint64_t now, bool &changed) {
+    proc_stat st;
+    bool alive = read_stat(pid, st) && st.state != 'Z' && st.state != 'X';
+
+    auto it = procs.find(pid);
+
+    if (it != procs.end() && (!alive || it->second.starttime != st.starttime)) {
+        changed = true;
+        if (!it->second.reported) report_start(pid, it->second);
+        proc_exited(pid, now, st.starttime == it->second.starttime && st.state == 'Z' ? &st : nullptr);
+        it = procs.end();
+    }
+
+    if (!alive) return;
+
+    if (it == procs.end()) {
+        changed = true;
+
+        auto parent = procs.find(st.ppid);
+        std::string parent_comm = parent != procs.end() ? parent->second.comm : self_comm;
+
+        auto &p = procs[pid];
+        p.starttime = st.starttime;
+        p.generation = generation;
+        p.ppid = st.ppid;
+        p.comm = st.comm;
+        // Dated from the fork rather than when this scan noticed it
+        p.first_seen = std::min(now, logp::util::proc_starttime_to_wall(st.starttime) + logp::util::proc_starttime_resolution());
+        p.argv = read_argv(pid);
+
+        if (st.comm != parent_comm) report_start(pid, p);
+    } else {
+        auto &p = it->second;
+        p.generation = generation;
+
+        if (!p.reported) {
+            if (st.comm != p.comm) {
+                p.comm = st.comm;
+                p.argv = read_argv(pid);
+            }
+            report_start(pid, p);
+        }
+    }
+
+    std::vector<pid_t> children;
+    read_children(pid, st.num_threads, children);
+
+    for (auto child : children) {
+        auto c = procs.find(child);
+        if (c == procs.end() || c->second.generation != generation) visit(child, generation, now, changed);
+    }
+}
+
+
+void proc_watcher::report_start(pid_t pid, tracked_proc &p) {
+    p.reported = true;
+
+    // Parents are reported before their children
+    auto parent = procs.find(p.ppid);
+    if (parent != procs.end() && !parent->second.reported) report_start(p.ppid, parent->second);
+
+    nlohmann::json data = {{ "pid", pid }, { "ppid", p.ppid }, { "argv", std::move(p.argv) }};
+    p.argv = nullptr;
+
+    if (on_proc_start) on_proc_start(p.first_seen, data);
+}
+
+
+void proc_watcher::proc_exited(pid_t pid, uint64_t now, proc_stat *st) {
+    procs.erase(pid);
+
+    nlohmann::json data = {{ "pid", pid }};
+
+    if (st) {
+        // Zombies still have their final counters and exit status
+        static const uint64_t usecs_per_tick = 1000000 / sysconf(_SC_CLK_TCK);
+
+        data["rusage"] = {
+            { "utime", st->utime * usecs_per_tick },
+            { "stime", st->stime * usecs_per_tick },
+            { "minflt", st->minflt },
+            { "majflt", st->majflt },
+        };
+
+        if (st->has_exit_code) {
+            int status = st->exit_code;
+
+            if (WIFEXITED(status)) {
+                data["term"] = "exit";
+                data["exit"] = WEXITSTATUS(status);
+            } else if (WIFSIGNALED(status)) {
+                data["term"] = "signal";
+                data["signal"] = strsignal(WTERMSIG(status));
+            }
+        }
+    }
+
+    if (on_proc_end) on_proc_end(now, data);
+}
+
+
+bool proc_watcher::read_stat(pid_t pid, proc_stat &st) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    std::string &contents = buf;
+    if (!logp::util::read_file(path, contents)) return false;
+
+    // The command name is in parentheses and may itself contain spaces and parentheses
+    size_t p = contents.rfind(')');
+    if (p == std::string::npos || p + 2 >= contents.size()) return false;
+
+    size_t comm_start = contents.find('(');
+    if (comm_start < p) st.comm = contents.substr(comm_start + 1, p - comm_start - 1);
+
+    const char *c = contents.c_str() + p + 2;
+    st.state = *c;
+
+    // Fields are numbered from 1 (the pid); c is at field 3
+    for (int field = 3; *c; field++) {
+        char *end;
+
+        if (field > 3) {
+            uint64_t v = strtoull(c, &end, 10);
+
+            switch (field) {
+                case 4: st.ppid = v; break;
+                case 10: st.minflt = v; break;
+                case 12: st.majflt = v; break;
+                case 14: st.utime = v; break;
+                case 15: st.stime = v; break;
+                case 20: st.num_threads = v; break;
+                case 22: st.starttime = v; break;
+                case 52: st.exit_code = v; st.has_exit_code = true; break;
+            }
+        }
+
+        c = strchr(c, ' ');
+        if (!c) break;
+        c++;
+    }
+
+    return true;
+}
+
+
+nlohmann::json proc_watcher::read_argv(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+
+    nlohmann::json argv = nlohmann::json::array();
+
+    std::string &contents = buf;
+    if (!logp::util::read_file(path, contents)) return argv;
+
+    size_t start = 0;
+    while (start < contents.size()) {
+        size_t end = contents.find('\0', start);
+        if (end == std::string::npos) end = contents.size();
+        argv.push_back(std::string(contents.data() + start, end - start));
+        start = end + 1;
+    }
+
+    return argv;
+}
+
+
+void proc_watcher::read_children(pid_t pid, uint64_t num_threads, std::vector<pid_t> &out) {
+    char path[96];
+
+    std::vector<std::string> tids;
+
+    if (num_threads <= 1) {
+        tids.push_back(std::to_string(pid));
+    } else {
+        // Children belong to whichever thread forked them
+        snprintf(path, sizeof(path), "/proc/%d/task", pid);
+
+        DIR *dir = opendir(path);
+        if (!dir) return;
+
+        struct dirent *ent;
+        while ((ent = readdir(dir))) {
+            if (ent->d_name[0] != '.') tids.push_back(ent->d_name);
+        }
+
+        closedir(dir);
+    }
+
+    for (auto &tid : tids) {
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/children", pid, tid.c_str());
+        if (!logp::util::read_file(path, buf)) continue;
+
+        const char *c = buf.c_str();
+        char *end;
+
+        while (1) {
+            long child = strtol(c, &end, 10);
+            if (end == c) break;
+            out.push_back(child);
+            c = end;
+        }
+    }
+}
+
+}
@@ -0,0 +1,271 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/ptrace.h>
+#endif
+
+#include <string>
+#include <fstream>
+
+#include "logp/util.h"
+#include "logp/ptracewatcher.h"
+
+
+namespace logp {
+
+
+bool ptrace_watcher::supported() {
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+void ptrace_watcher::prepare() {
+    if (pipe(sync_pipe)) throw logp::error("unable to create pipe: ", strerror(errno));
+
+    fcntl(sync_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sync_pipe[1], F_SETFD, FD_CLOEXEC);
+}
+
+
+void ptrace_watcher::child() {
+    close(sync_pipe[1]);
+
+    char c;
+    while (read(sync_pipe[0], &c, 1) == -1 && errno == EINTR) {}
+
+    close(sync_pipe[0]);
+}
+
+
+void ptrace_watcher::run(pid_t root_pid) {
+    root = root_pid;
+
+    close(sync_pipe[0]);
+
+    t = std::thread([this]() {
+        trace();
+    });
+}
+
+
+static pid_t read_tgid(pid_t tid) {
+    std::ifstream status(std::string("/proc/") + std::to_string(tid) + "/status");
+    std::string line;
+
+    while (std::getline(status, line)) {
+        if (line.compare(0, 5, "Tgid:") == 0) return atoi(line.c_str() + 5);
+    }
+
+    return -1;
+}
+
+
+static nlohmann::json read_argv(pid_t pid) {
+    std::ifstream cmdline(std::string("/proc/") + std::to_string(pid) + "/cmdline");
+    std::string arg;
+
+    nlohmann::json argv = nlohmann::json::array();
+    while (std::getline(cmdline, arg, '\0')) argv.push_back(arg);
+
+    return argv;
+}
+
+
+void ptrace_watcher::trace() {
+#ifdef __linux__
+    // The tracer must be the thread that attaches, so this happens here rather than in run()
+    long opts = PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC;
+
+    if (ptrace(PTRACE_SEIZE, root, 0, opts) == 0) {
+        task_tgid[root] = root;
+
+        auto &p = procs[root];
+        p.ppid = getpid();
+        p.fork_ts = logp::util::curr_time();
+        p.argv = nlohmann::json::array();
+    } else {
+        PRINT_WARNING << "unable to ptrace job, its processes won't be followed: " << strerror(errno);
+    }
+
+    // Let the job exec
+    char c = 0;
+    if (write(sync_pipe[1], &c, 1) != 1) PRINT_ERROR << "unable to release traced job: " << strerror(errno);
+    close(sync_pipe[1]);
+
+    while (1) {
+        int status;
+        struct rusage ru;
+
+        pid_t tid = wait4(-1, &status, __WALL, &ru);
+        if (tid == -1) {
+            if (errno == EINTR) continue;
+            break; // ECHILD: everything has exited
+        }
+
+        uint64_t now = logp::util::curr_time();
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            task_exited(tid, status, now);
+            if (tid == root && on_root_exit) on_root_exit(now, status, ru);
+            continue;
+        }
+
+        if (!WIFSTOPPED(status)) continue;
+
+        stops++;
+
+        int sig = WSTOPSIG(status);
+        int event = (unsigned)status >> 16;
+        unsigned long msg = 0;
+
+        // New tasks are attached automatically and start in a stop, which can
+        // arrive before or after the event in their parent
+        if (event == PTRACE_EVENT_STOP) {
+            if (awaiting_stop.erase(tid)) {
+                ptrace(PTRACE_CONT, tid, 0, 0);
+                continue;
+            } else if (!task_tgid.count(tid)) {
+                // Kept stopped until then, so its own children find it
+                stopped_early.insert(tid);
+                continue;
+            }
+        }
+
+        switch (event) {
+            case PTRACE_EVENT_FORK:
+            case PTRACE_EVENT_VFORK:
+            case PTRACE_EVENT_CLONE:
+                if (ptrace(PTRACE_GETEVENTMSG, tid, 0, &msg) == 0) task_created(tid, msg, now);
+                ptrace(PTRACE_CONT, tid, 0, 0);
+                break;
+
+            case PTRACE_EVENT_EXEC:
+                // When a non-leader thread execs it takes over the leader's pid
+                if (ptrace(PTRACE_GETEVENTMSG, tid, 0, &msg) == 0 && (pid_t)msg != tid) task_tgid.erase(msg);
+                execed(tid, now);
+                ptrace(PTRACE_CONT, tid, 0, 0);
+                break;
+
+            case PTRACE_EVENT_STOP:
+                // Group-stop (SIGSTOP, ^Z etc): stay stopped without holding up SIGCONT
+                if (sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN || sig == SIGTTOU) ptrace(PTRACE_LISTEN, tid, 0, 0);
+                else ptrace(PTRACE_CONT, tid, 0, 0);
+                break;
+
+            default:
+                // Signal-delivery-stop: pass the signal on
+                ptrace(PTRACE_CONT, tid, 0, sig);
+                break;
+        }
+    }
+#endif
+}
+
+
+void ptrace_watcher::task_created(pid_t parent_tid, pid_t tid, uint64_t now) {
+    bool was_stopped = stopped_early.erase(tid);
+    if (!was_stopped) awaiting_stop.insert(tid);
+
+    record_task(parent_tid, tid, now);
+
+    if (was_stopped) ptrace(PTRACE_CONT, tid, 0, 0);
+}
+
+
+void ptrace_watcher::record_task(pid_t parent_tid, pid_t tid, uint64_t now) {
+    auto parent_it = task_tgid.find(parent_tid);
+    pid_t parent = parent_it != task_tgid.end() ? parent_it->second : parent_tid;
+
+    if (read_tgid(tid) == parent) {
+        task_tgid[tid] = parent; // a thread
+        return;
+    }
+
+    task_tgid[tid] = tid;
+
+    auto pp = procs.find(parent);
+    nlohmann::json argv = pp != procs.end() ? pp->second.argv : nlohmann::json::array();
+
+    auto &p = procs[tid];
+    p.ppid = parent;
+    p.fork_ts = now;
+    p.argv = std::move(argv);
+    p.reported = false;
+}
+
+
+void ptrace_watcher::execed(pid_t pid, uint64_t now) {
+    auto it = procs.find(pid);
+    if (it == procs.end()) return;
+
+    if (it->second.reported) {
+        // Same as logp_preload.so: a new image ends the previous one
+        nlohmann::json data = {{ "pid", pid }};
+        if (on_proc_end) on_proc_end(now, data);
+    }
+
+    it->second.argv = read_argv(pid);
+    report_start(pid, now, false);
+}
+
+
+void ptrace_watcher::report_start(pid_t pid, uint64_t ts, bool forked) {
+    auto &p = procs.at(pid);
+    p.reported = true;
+
+    // Parents are reported before their children
+    auto parent = procs.find(p.ppid);
+    if (parent != procs.end() && !parent->second.reported) report_start(p.ppid, parent->second.fork_ts, true);
+
+    nlohmann::json data = {{ "pid", pid }, { "ppid", p.ppid }, { "argv", p.argv }};
+    if (forked) data["fork"] = true; // never exec()ed, argv is the parent's
+
+    if (on_proc_start) on_proc_start(ts, data);
+}
+
+
+void ptrace_watcher::task_exited(pid_t tid, int status, uint64_t now) {
+    awaiting_stop.erase(tid);
+    stopped_early.erase(tid);
+
+    auto tg = task_tgid.find(tid);
+    if (tg == task_tgid.end()) return;
+
+    pid_t tgid = tg->second;
+    task_tgid.erase(tg);
+
+    if (tgid != tid) return; // a thread
+
+    auto it = procs.find(tid);
+    if (it == procs.end()) return;
+
+    if (!it->second.reported) report_start(tid, it->second.fork_ts, true);
+
+    nlohmann::json data = {{ "pid", tid }};
+
+    if (WIFEXITED(status)) {
+        data["term"] = "exit";
+        data["exit"] = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        data["term"] = "signal";
+        data["signal"] = strsignal(WTERMSIG(status));
+        if (WCOREDUMP(status)) data["core"] = true;
+    }
+
+    procs.erase(tid);
+
+    if (on_proc_end) on_proc_end(now, data);
+}
+
+}
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include <string>
+
+#include "logp/util.h"
+#include "logp/pty.h"
+
+
+namespace logp {
+
+static bool saved_termios_valid = false;
+static struct termios saved_termios;
+
+static void restore_stdin_termios() {
+    if (saved_termios_valid) tcsetattr(0, TCSAFLUSH, &saved_termios);
+}
+
+
+pty::pty() {
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd == -1) throw logp::error("unable to open pty: ", strerror(errno));
+
+    if (grantpt(master_fd) != 0 || unlockpt(master_fd) != 0) throw logp::error("unable to set up pty: ", strerror(errno));
+
+    char *name = ptsname(master_fd);
+    if (!name) throw logp::error("unable to get pty slave name: ", strerror(errno));
+    slave_path = name;
+
+    fcntl(master_fd, F_SETFD, FD_CLOEXEC);
+
+    stdin_is_tty = isatty(0);
+
+    if (stdin_is_tty && tcgetattr(0, &slave_termios) == 0) have_termios = true;
+
+    resize();
+}
+
+
+pty::~pty() {
+    if (master_fd != -1) close(master_fd);
+}
+
+
+void pty::child() {
+    if (setsid() == -1) {
+        PRINT_ERROR << "unable to setsid: " << strerror(errno);
+        _exit(1);
+    }
+
+    int slave_fd = open(slave_path.c_str(), O_RDWR);
+    if (slave_fd == -1) {
+        PRINT_ERROR << "unable to open pty slave '" << slave_path << "': " << strerror(errno);
+        _exit(1);
+    }
+
+#ifdef TIOCSCTTY
+    ioctl(slave_fd, TIOCSCTTY, 0);
+#endif
+
+    if (have_termios) {
+        tcsetattr(slave_fd, TCSANOW, &slave_termios);
+    } else {
+        // Input isn't being typed, so don't echo it into the captured output
+        struct termios t;
+        if (tcgetattr(slave_fd, &t) == 0) {
+            t.c_lflag &= ~ECHO;
+            tcsetattr(slave_fd, TCSANOW, &t);
+        }
+    }
+
+    dup2(slave_fd, 0);
+    dup2(slave_fd, 1);
+    dup2(slave_fd, 2);
+    if (slave_fd > 2) close(slave_fd);
+}
+
+
+void pty::parent() {
+    // Put our terminal in raw mode so keystrokes (including ^C) reach the child's
+    // terminal unchanged. Skip it if we are in the background.
+    if (stdin_is_tty && tcgetpgrp(0) == getpgrp() && tcgetattr(0, &saved_termios) == 0) {
+        struct termios raw = saved_termios;
+        cfmakeraw(&raw);
+
+        if (tcsetattr(0, TCSAFLUSH, &raw) == 0) {
+            saved_termios_valid = true;
+            ::atexit(restore_stdin_termios);
+        }
+    }
+
+    // A terminal we didn't put in raw mode belongs to someone else (we're in the background)
+    if (stdin_is_tty && !saved_termios_valid) return;
+
+    stdin_thread = std::thread([this]() {
+        forward_stdin();
+    });
+
+    stdin_thread.detach();
+}
+
+
+void pty::resize() {
+    struct winsize ws;
+
+    if (ioctl(1, TIOCGWINSZ, &ws) != 0 && ioctl(0, TIOCGWINSZ, &ws) != 0) return;
+
+    ioctl(master_fd, TIOCSWINSZ, &ws);
+}
+
+
+void pty::forward_stdin() {
+    char buf[4096];
+
+    while (1) {
+        ssize_t ret = ::read(0, buf, sizeof(buf));
+
+        if (ret == -1 && errno == EINTR) continue;
+
+        if (ret <= 0) {
+            // Pass EOF on as the terminal's end-of-file character
+            if (!stdin_is_tty) {
+                struct termios t;
+                char eof = (tcgetattr(master_fd, &t) == 0) ? t.c_cc[VEOF] : 4;
+                if (::write(master_fd, &eof, 1) != 1) PRINT_DEBUG << "unable to pass EOF to pty: " << strerror(errno);
+            }
+
+            return;
+        }
+
+        size_t written = 0;
+
+        while (written < static_cast<size_t>(ret)) {
+            ssize_t wret = ::write(master_fd, buf + written, ret - written);
+            if (wret <= 0) {
+                if (wret == -1 && errno == EINTR) continue;
+                return;
+            }
+            written += wret;
+        }
+    }
+}
+
+
+}
@@ -4,12 +4,18 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <pwd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <cstdlib>
 #include <thread>
 #include <chrono>
 #include <string>
+#include <algorithm>
 
 #include "logp/util.h"
 
@@ -46,10 +52,108 @@ uint64_t curr_time() {
     return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+bool read_file(const char *path, std::string &out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    out.resize(4096);
+    size_t len = 0;
+
+    while (1) {
+        if (len == out.size()) out.resize(out.size() * 2);
+
+        ssize_t ret = read(fd, &out[len], out.size() - len);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return false;
+        }
+        if (ret == 0) break;
+        len += ret;
+    }
+
+    close(fd);
+    out.resize(len);
+    return true;
+}
+
 uint64_t timeval_to_usecs(struct timeval &tv) {
     return (tv.tv_sec * 1000000) + tv.tv_usec;
 }
 
+static uint64_t clock_usecs(clockid_t clock) {
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) != 0) return 0;
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t monotonic_time() {
+    return clock_usecs(CLOCK_MONOTONIC);
+}
+
+uint64_t process_start_time = 0;
+
+uint64_t monotonic_to_wall(uint64_t monotonic_usecs) {
+    uint64_t wall_now = curr_time();
+    uint64_t monotonic_now = monotonic_time();
+
+    if (!monotonic_now || monotonic_usecs > monotonic_now || monotonic_now - monotonic_usecs > wall_now) return wall_now;
+    return wall_now - (monotonic_now - monotonic_usecs);
+}
+
+uint64_t proc_starttime_resolution() {
+    static const uint64_t usecs_per_tick = 1000000 / sysconf(_SC_CLK_TCK);
+    return usecs_per_tick;
+}
+
+uint64_t proc_starttime_to_wall(uint64_t ticks) {
+#ifdef CLOCK_BOOTTIME
+    // starttime counts from boot, including time spent suspended
+    uint64_t since_boot = clock_usecs(CLOCK_BOOTTIME);
+#else
+    uint64_t since_boot = monotonic_time();
+#endif
+    uint64_t wall_now = curr_time();
+    uint64_t started = ticks * proc_starttime_resolution();
+
+    if (!since_boot || started > since_boot || since_boot - started > wall_now) return wall_now;
+    return wall_now - (since_boot - started);
+}
+
+
+// Used on every captured read when line framing is enabled, so it is vectorized:
+// byte-wise compare results are accumulated in 8-bit lanes for up to 255 blocks
+// before being horizontally summed with psadbw.
+
+size_t count_newlines(const char *data, size_t len) {
+    size_t count = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+
+    while (len - i >= 16) {
+        size_t blocks = std::min<size_t>((len - i) / 16, 255);
+        __m128i acc = zero;
+
+        for (size_t b = 0; b < blocks; b++, i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, newline));
+        }
+
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        count += static_cast<size_t>(_mm_cvtsi128_si32(sums)) + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(sums, 8)));
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (data[i] == '\n') count++;
+    }
+
+    return count;
+}
+
 
 
 
@@ -113,6 +217,71 @@ std::string utf8_decode_binary(std::string &input) {
 
 
 
+// Compressed output is uploaded as base64: raw binary would mostly be escaped or
+// UTF-8 encoded by the rules above and roughly double in size.
+
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string base64_encode(const std::string &input) {
+    std::string output;
+    output.reserve(((input.size() + 2) / 3) * 4);
+
+    size_t i = 0;
+
+    for (; i + 2 < input.size(); i += 3) {
+        uint32_t v = (static_cast<unsigned char>(input[i]) << 16) | (static_cast<unsigned char>(input[i+1]) << 8) | static_cast<unsigned char>(input[i+2]);
+        output += base64_chars[(v >> 18) & 0x3f];
+        output += base64_chars[(v >> 12) & 0x3f];
+        output += base64_chars[(v >> 6) & 0x3f];
+        output += base64_chars[v & 0x3f];
+    }
+
+    if (i < input.size()) {
+        uint32_t v = static_cast<unsigned char>(input[i]) << 16;
+        if (i + 1 < input.size()) v |= static_cast<unsigned char>(input[i+1]) << 8;
+
+        output += base64_chars[(v >> 18) & 0x3f];
+        output += base64_chars[(v >> 12) & 0x3f];
+        output += i + 1 < input.size() ? base64_chars[(v >> 6) & 0x3f] : '=';
+        output += '=';
+    }
+
+    return output;
+}
+
+std::string base64_decode(const std::string &input) {
+    std::string output;
+    output.reserve((input.size() / 4) * 3);
+
+    uint32_t v = 0;
+    int bits = 0;
+
+    for (unsigned char c : input) {
+        int d;
+
+        if (c >= 'A' && c <= 'Z') d = c - 'A';
+        else if (c >= 'a' && c <= 'z') d = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') d = c - '0' + 52;
+        else if (c == '+') d = 62;
+        else if (c == '/') d = 63;
+        else if (c == '=') break;
+        else throw logp::error("unrecognized character in base64 input: ", (int)c);
+
+        v = (v << 6) | d;
+        bits += 6;
+
+        if (bits >= 8) {
+            bits -= 8;
+            output += static_cast<char>((v >> bits) & 0xff);
+        }
+    }
+
+    return output;
+}
+
+
+
+
 bool use_ansi_colours = false;
 
 std::string colour_bold(std::string s) {